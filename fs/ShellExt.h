@@ -196,7 +196,7 @@ public:
 	IShellExt *ShellExt = nullptr;
 	CUnkPtr iShellExt;
 
-	Volume *Vol = nullptr;
+	shared_ptr<Volume> Vol;
 
 	vector<DataObject> m_aDataItems;   // Stored clipboard items
 
@@ -252,7 +252,7 @@ public:
 	void AddDataObjectOnHGLOBAL(CLIPFORMAT cfFormat, DWORD dwValue);
 	void AddDataObjectPlaceholder(CLIPFORMAT cfFormat, DWORD tymed);
 	void CollectFile(RCString name);
-	void Init(IShellExt* shellExt, CUnkPtr iShellExt, Volume *vol, HWND hWnd, LPCITEMIDLIST* pPidls, int nCount);
+	void Init(IShellExt* shellExt, CUnkPtr iShellExt, shared_ptr<Volume> vol, HWND hWnd, LPCITEMIDLIST* pPidls, int nCount);
 
 	// IDataObject
 
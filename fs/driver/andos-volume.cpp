@@ -55,14 +55,11 @@ protected:
 				, date & 0b11111);			// day
 	}
 
-	vector<DirEntry> GetDirEntries(uint32_t dirId, bool bWithExtra) override {
-		auto files = base::GetDirEntries(0, bWithExtra);
-		for (auto it = files.begin(); it != files.end();) {
-			it = !bWithExtra && it->Aux2 != dirId
-				? files.erase(it)
-				: ++it;
-		}
-		return files;
+	bool EnumDirEntries(uint32_t dirId, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
+		return base::EnumDirEntries(0, bWithExtra, [&](const DirEntry& e) {
+			return (!bWithExtra && e.Aux2 != dirId) || f(e);		// Skips entries of other directories
+		});
 	}
 
 	DirEntry AllocateFileEntry() override {
@@ -85,9 +82,8 @@ protected:
 		return r;
 	}
 
-	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override {
-		OptionalCopyHeader(fileEntry, os);
-		FatVolume::CopyFileTo(fileEntry, os);
+	vector<Extent> GetFileExtents(const DirEntry& entry) override {
+		return FatVolume::GetFileExtents(entry);			// Not contiguous like other BK filesystems
 	}
 };
 
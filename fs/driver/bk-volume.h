@@ -37,15 +37,19 @@ protected:
 		}
 	}
 
-	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override {
+	uint32_t RootDirectoryId() override { return RootDirId; }
+	uint32_t SubdirectoryId(const DirEntry& dir) override { return dir.Aux1; }
+
+	void WriteFilePrefix(const DirEntry& fileEntry, Stream& os) override {
 		OptionalCopyHeader(fileEntry, os);
-		Fs.Position = (uint64_t)fileEntry.FirstCluster * BytesPerSector;
-		array<byte, 512> buf;
-		for (int64_t len = fileEntry.Length; len > 0; len -= buf.size()) {
-			size_t cb = (size_t)min(len, (int64_t)buf.size());
-			Fs.ReadExactly(buf.data(), cb);
-			os.WriteBuffer(buf.data(), cb);
-		}
+	}
+
+	// Files are contiguous
+	vector<Extent> GetFileExtents(const DirEntry& entry) override {
+		vector<Extent> r;
+		if (entry.Length)
+			r.push_back(Extent{ entry.FirstCluster, CalcNumberOfClusters(entry.Length) * SectorsPerCluster });
+		return r;
 	}
 
 	// Detect and skip .BIN address/length header
@@ -97,7 +101,7 @@ protected:
 		} else if (name == "..") {
 			CurDirId = ParentDirId;
 			if (CurDirId != RootDirId) {
-				auto entries = GetDirEntries(RootDirId, true);
+				auto entries = ListDirectory(RootDirId, true);
 				for (auto& e : entries)
 					if (e.Aux1 == CurDirId) {
 						ParentDirId = (uint8_t)e.Aux2;
@@ -114,7 +118,7 @@ protected:
 			ParentDirId = CurDirId;
 			CurDirId = (uint8_t)e.Aux1;
 		}
-		Files = GetDirEntries(CurDirId, false);
+		Files = ListDirectory(CurDirId);
 	}
 };
 
@@ -0,0 +1,310 @@
+// © 2023 Ufasoft https://ufasoft.com, Sergey Pavlov mailto:dev@ufasoft.com
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+// Random access to gzip-compressed images.
+// On first open for mounting the whole image is inflated once, saving decompressor state (bit position and the last 32 KB
+// of output) at deflate block boundaries. A read restarts from the nearest preceding checkpoint.
+//
+// Based on
+//		Mark Adler - zran.c, zlib/examples
+
+#include "pch.h"
+
+#include <zlib.h>
+
+#include "volume.h"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace U::FS {
+
+namespace {
+
+const uint32_t c_windowSize = 32768;
+const uint64_t c_minCheckpointSpan = 1024 * 1024;
+const uint32_t c_maxCheckpoints = 1024;							// Each checkpoint holds a 32 KB window
+const uint32_t c_indexMagic = 0x58445A47						// "GZDX"
+	, c_indexVersion = 1;
+
+struct IndexHeader {
+	uint32_t Magic, Version;
+	uint64_t CompressedSize, LastWriteTime, Length, Span;
+	uint32_t Count, Reserved;
+};
+
+struct IndexEntry {
+	uint64_t Out, In;
+	uint32_t Bits, HasWindow;
+};
+
+class GzipImage : public CompressedImage {
+public:
+	GzipImage(const path& p);
+
+	~GzipImage() {
+		if (inflating_)
+			inflateEnd(&strm_);
+	}
+
+	size_t ReadAt(uint64_t offset, void* buf, size_t size) override;
+private:
+	struct Checkpoint {
+		uint64_t Out, In;			// Offsets in uncompressed and compressed data
+		int Bits;					// Bits of the byte at In - 1 not yet consumed
+		vector<uint8_t> Window;		// Last 32 KB of output before Out. Empty for the start of the file
+	};
+
+	FileStream fs_;
+	path indexPath_;
+	uint64_t compressedSize_, lastWriteTime_;
+	uint64_t span_;
+	vector<Checkpoint> checkpoints_;
+
+	z_stream strm_;
+	vector<uint8_t> in_;
+	uint64_t pos_ = 0;				// Uncompressed offset of the next inflated byte
+	bool inflating_ = false
+		, raw_ = false;				// Raw deflate mode leaves the gzip trailer to us
+
+	void Restart(const Checkpoint& cp);
+	bool FillInput();
+	bool NextMember();
+	size_t Inflate(uint8_t* out, size_t size);
+	void BuildIndex();
+	bool LoadIndex();
+	void SaveIndex();
+};
+
+GzipImage::GzipImage(const path& p)
+	: indexPath_(path(p) += ".gzidx")
+	, in_(64 * 1024)
+{
+	fs_.Open(p, FileMode::Open, FileAccess::Read, FileShare::Read);
+	compressedSize_ = fs_.Length;
+	lastWriteTime_ = (uint64_t)last_write_time(p).time_since_epoch().count();
+	span_ = max(c_minCheckpointSpan, compressedSize_ * 4 / c_maxCheckpoints);	// Assume ~4:1 ratio
+	ZeroStruct(strm_);
+	if (!LoadIndex()) {
+		BuildIndex();
+		SaveIndex();
+	}
+}
+
+void GzipImage::Restart(const Checkpoint& cp) {
+	if (inflating_)
+		inflateEnd(&strm_);
+	inflating_ = false;
+	ZeroStruct(strm_);
+	raw_ = !cp.Window.empty();
+	if (inflateInit2(&strm_, raw_ ? -MAX_WBITS : MAX_WBITS + 16) != Z_OK)
+		Throw(errc::not_enough_memory);
+	inflating_ = true;
+	fs_.Position = cp.In - (cp.Bits ? 1 : 0);
+	if (cp.Bits) {
+		uint8_t b;
+		fs_.ReadExactly(&b, 1);
+		inflatePrime(&strm_, cp.Bits, b >> (8 - cp.Bits));
+	}
+	if (raw_)
+		inflateSetDictionary(&strm_, cp.Window.data(), c_windowSize);
+	pos_ = cp.Out;
+}
+
+bool GzipImage::FillInput() {
+	auto cb = fs_.Read(in_.data(), in_.size());
+	strm_.next_in = in_.data();
+	strm_.avail_in = (uInt)cb;
+	return cb;
+}
+
+// Concatenated gzip members form one image. Returns false at the end of the file
+bool GzipImage::NextMember() {
+	if (raw_) {
+		for (int n = 8; n;) {										// CRC32 and ISIZE
+			if (!strm_.avail_in && !FillInput())
+				return false;
+			auto k = min((uInt)n, strm_.avail_in);
+			strm_.next_in += k;
+			strm_.avail_in -= k;
+			n -= k;
+		}
+	}
+	if (!strm_.avail_in && !FillInput())
+		return false;
+	if (strm_.next_in[0] != 0x1F)								// Zero padding after the last member
+		return false;
+	inflateReset2(&strm_, MAX_WBITS + 16);
+	raw_ = false;
+	return true;
+}
+
+size_t GzipImage::Inflate(uint8_t* out, size_t size) {
+	strm_.next_out = out;
+	strm_.avail_out = (uInt)size;
+	while (strm_.avail_out) {
+		if (!strm_.avail_in && !FillInput())
+			Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+		int rc = inflate(&strm_, Z_NO_FLUSH);
+		if (rc == Z_STREAM_END) {
+			if (!NextMember())
+				break;
+		} else if (rc != Z_OK)
+			Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+	}
+	auto r = size - strm_.avail_out;
+	pos_ += r;
+	return r;
+}
+
+void GzipImage::BuildIndex() {
+	TRC(1, "Indexing " << indexPath_);
+
+	checkpoints_.assign(1, Checkpoint{ 0, 0, 0 });
+	Restart(checkpoints_.front());
+	vector<uint8_t> window(c_windowSize);						// Circular, output goes directly into it
+	strm_.avail_out = 0;
+	for (;;) {
+		if (!strm_.avail_out) {
+			strm_.next_out = window.data();
+			strm_.avail_out = c_windowSize;
+		}
+		if (!strm_.avail_in && !FillInput())
+			Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));			// Truncated member
+		auto availOut = strm_.avail_out;
+		int rc = inflate(&strm_, Z_BLOCK);
+		pos_ += availOut - strm_.avail_out;
+		if (rc == Z_STREAM_END) {
+			if (!NextMember())
+				break;
+			continue;
+		}
+		if (rc != Z_OK)
+			Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+		if ((strm_.data_type & 128) && !(strm_.data_type & 64) && pos_ - checkpoints_.back().Out >= span_) {	// Block boundary, not after the last block
+			Checkpoint cp = { pos_, fs_.Position - strm_.avail_in, strm_.data_type & 7 };
+			size_t head = c_windowSize - strm_.avail_out;
+			cp.Window.resize(c_windowSize);
+			copy(window.begin() + head, window.end(), cp.Window.begin());
+			copy(window.begin(), window.begin() + head, cp.Window.end() - head);
+			checkpoints_.push_back(std::move(cp));
+		}
+	}
+	length_ = pos_;
+	inflateEnd(&strm_);
+	inflating_ = false;
+}
+
+bool GzipImage::LoadIndex() {
+	try {
+		FileStream stm(indexPath_, FileMode::Open, FileAccess::Read);
+		IndexHeader h;
+		stm.ReadExactly(&h, sizeof h);
+		if (h.Magic != c_indexMagic || h.Version != c_indexVersion || h.CompressedSize != compressedSize_ || h.LastWriteTime != lastWriteTime_
+			|| !h.Count || !h.Span || h.Count > (stm.Length - sizeof h) / sizeof(IndexEntry))
+			return false;
+		checkpoints_.resize(h.Count);
+		for (size_t i = 0; i < checkpoints_.size(); ++i) {
+			auto& cp = checkpoints_[i];
+			IndexEntry e;
+			stm.ReadExactly(&e, sizeof e);
+			// ReadAt() relies on: the first checkpoint at the start of both streams, strictly increasing Out, windows everywhere else
+			if (e.Bits > 7 || e.In > compressedSize_ || e.Out > h.Length || bool(e.HasWindow) != (i > 0)
+				|| (i == 0 ? e.Out || e.In || e.Bits : e.Out <= checkpoints_[i - 1].Out || e.In < checkpoints_[i - 1].In)) {
+				checkpoints_.clear();
+				return false;
+			}
+			cp.Out = e.Out;
+			cp.In = e.In;
+			cp.Bits = e.Bits;
+			if (e.HasWindow) {
+				cp.Window.resize(c_windowSize);
+				stm.ReadExactly(cp.Window.data(), c_windowSize);
+			}
+		}
+		length_ = h.Length;
+		span_ = h.Span;
+		return true;
+	} catch (exception&) {
+		checkpoints_.clear();
+		return false;
+	}
+}
+
+void GzipImage::SaveIndex() {
+	try {
+		FileStream stm(indexPath_, FileMode::Create, FileAccess::Write);
+		IndexHeader h = { c_indexMagic, c_indexVersion, compressedSize_, lastWriteTime_, length_, span_, (uint32_t)checkpoints_.size() };
+		stm.WriteBuffer(&h, sizeof h);
+		for (auto& cp : checkpoints_) {
+			IndexEntry e = { cp.Out, cp.In, (uint32_t)cp.Bits, !cp.Window.empty() };
+			stm.WriteBuffer(&e, sizeof e);
+			if (e.HasWindow)
+				stm.WriteBuffer(cp.Window.data(), c_windowSize);
+		}
+	} catch (exception&) {											// Read-only location: rebuild on next open
+		TRC(1, "Cannot save " << indexPath_);
+	}
+}
+
+size_t GzipImage::ReadAt(uint64_t offset, void* buf, size_t size) {
+	if (offset >= length_)
+		return 0;
+	size = (size_t)min((uint64_t)size, length_ - offset);
+	auto it = prev(upper_bound(checkpoints_.begin(), checkpoints_.end(), offset, [](uint64_t off, const Checkpoint& cp) { return off < cp.Out; }));
+	if (!inflating_ || offset < pos_ || it->Out > pos_)		// Sequential reads continue without restarting
+		Restart(*it);
+	vector<uint8_t> discard;
+	while (pos_ < offset) {
+		discard.resize((size_t)min(offset - pos_, (uint64_t)c_windowSize));
+		if (Inflate(discard.data(), discard.size()) != discard.size())
+			Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+	}
+	auto p = (uint8_t*)buf;
+	size_t r = 0;
+	for (size_t cb; r < size; r += cb) {
+		auto chunk = min(size - r, (size_t)numeric_limits<uInt>::max());
+		if (!(cb = Inflate(p + r, chunk)))
+			break;
+	}
+	return r;
+}
+
+} // namespace
+
+bool CompressedImage::IsCompressed(RCSpan head) {
+	return head.size() >= 2 && head.data()[0] == 0x1F && head.data()[1] == 0x8B;
+}
+
+// Stops quietly at corrupt or truncated data: the caller only probes what was inflated
+size_t CompressedImage::ReadHead(const path& p, void* buf, size_t size) {
+	FileStream fs(p, FileMode::Open, FileAccess::Read);
+	z_stream strm;
+	ZeroStruct(strm);
+	if (inflateInit2(&strm, MAX_WBITS + 16) != Z_OK)
+		Throw(errc::not_enough_memory);
+	vector<uint8_t> in(64 * 1024);
+	strm.next_out = (Bytef*)buf;
+	strm.avail_out = (uInt)size;
+	for (int rc = Z_OK; rc == Z_OK && strm.avail_out;) {
+		if (!strm.avail_in) {
+			if (!(strm.avail_in = (uInt)fs.Read(in.data(), in.size())))
+				break;
+			strm.next_in = in.data();
+		}
+		rc = inflate(&strm, Z_NO_FLUSH);
+	}
+	auto r = size - strm.avail_out;
+	inflateEnd(&strm);
+	return r;
+}
+
+// Other formats plug in here by their magic
+unique_ptr<CompressedImage> CompressedImage::Open(const path& p) {
+	uint8_t head[2];
+	if (FileStream(p, FileMode::Open, FileAccess::Read).Read(head, sizeof head) == sizeof head && IsCompressed(Span(head, sizeof head)))
+		return unique_ptr<CompressedImage>(new GzipImage(p));
+	return nullptr;
+}
+
+} // U::FS
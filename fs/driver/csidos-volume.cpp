@@ -31,13 +31,11 @@ public:
 		FirstDataCluster = 10;
 	}
 protected:
-	vector<DirEntry> GetDirEntries(uint32_t dirId, bool bWithExtra) override {
-		vector<DirEntry> r;
-		vector<uint8_t> buf(BytesPerSector);
+	bool EnumDirEntries(uint32_t dirId, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
+		auto catalog = GetSectors(2, 8);
 		for (int sector = 2; sector <= 9; ++sector) {
-			Fs.Position = sector * BytesPerSector;
-			Fs.ReadExactly(buf.data(), buf.size());
-			const uint8_t* p = buf.data();
+			const uint8_t* p = catalog.data() + (sector - 2) * BytesPerSector;
 			if (p[0] != sector)					// Corrupted
 				continue;
 			p += 12;
@@ -54,27 +52,26 @@ protected:
 						e.Aux2 = p[0];
 						e.ReadOnly = p[1] & 0x80;
 						e.IsDirectory = !p[10];
-						auto fn = GetFilenamePart(Span(p + 2, 8));
 						e.Aux1 = p[13];
 						if (e.IsDirectory) {
-							e.FileName = fn;
+							e.FileName = GetFilenamePart(Span(p + 2, 8));
 							e.FirstCluster = p[13];		// DirId, copy of Aux1
 						} else {
-							auto ext = GetFilenamePart(Span(p + 10, 3));
-							e.FileName = ext != "   " ? fn + "." + ext : fn;
+							e.FileName = GetFilename(Span(p + 2, 8), Span(p + 10, 3));
 							e.Length = load_little_u16(p + 18);
 							if (e.Length)
 								e.AllocationSize = (e.Length | 511) + 1;
 							e.FirstCluster = load_little_u16(p + 14);
 						}
 						e.Aux3 = load_little_u16(p + 16);			// Load Address
-						r.push_back(e);
+						if (!f(e))
+							return false;
 					}
 				}
 			}
 		}
 LAB_END:
-		return r;
+		return true;
 	}
 
 	void Serialize(Stream& stm, const DirEntry& e) override {
@@ -111,7 +108,7 @@ LAB_END:
 			uint8_t buf[500];
 			ZeroStruct(buf);
 			stm.Read(buf, sizeof(buf));
-			Fs.Write((2 + i) * BytesPerSector + 12, buf);
+			WriteAt((2 + i) * BytesPerSector + 12, buf);
 		}
 	}
 
@@ -122,22 +119,23 @@ LAB_END:
 	}
 
 	void RemoveFile(RCString filename) override {
+		auto timer = Stats.Time(VolumeOp::RemoveFile);
 		RemoveFileChecks(filename);
 		auto& e = *GetEntry(filename);
 		uint8_t deletedMark = (uint8_t)EntryStatus::Deleted;
-		Fs.Write(e.DirEntryDiskOffset, Span(&deletedMark, 1));
+		WriteAt(e.DirEntryDiskOffset, Span(&deletedMark, 1));
 	}
 
 	void Init(const path& filepath) override {
+		auto timer = Stats.Time(VolumeOp::Init);
 		base::Init(filepath);
 
 		uint8_t buf[512];
-		Fs.Position = 1024;
-		Fs.ReadExactly(buf, sizeof(buf));
+		ReadAt(1024, buf, sizeof(buf));
 		TotalSectors = load_little_u16(buf + 2);
 
 		CurDirId = 1;
-		Files = GetDirEntries(CurDirId, false);
+		Files = ListDirectory(CurDirId);
 	}
 
 	int64_t FreeSpace() {
@@ -27,83 +27,199 @@ FatDateTime FatDateTime::Clamp(const DateTime& dt) {
 	return FatDateTime(DateTime(clamp(dt.Ticks, Min.Ticks, Max.Ticks)));
 }
 
-void FatVolume::LoadFat() {
-	Fs.Position = (uint32_t)ReservedSectors * BytesPerSector;
-	auto bytesPerFat = SectorsPerFat * BytesPerSector;
-	auto bitsPerFatEntry = Kind == FatKind::Fat32 ? 32 : Kind == FatKind::Fat16 ? 16 : 12;
-	uint32_t n = uint32_t(bytesPerFat * 8 / bitsPerFatEntry);
-	Fat.clear();
-	Fat.reserve(n);
-	uint8_t prev;
-	bool bAlignPos = true;
-	for (uint32_t i = 0; i < n; ++i) {
-		uint32_t e = 0;
-		uint8_t buf[4];
-		switch (Kind) {
-		case FatKind::Fat12:
-			if (bAlignPos) {
-				Fs.ReadExactly(buf, 2);
-				e = load_little_u16(buf) & 0xFFF;
-				prev = buf[1] >> 4;
-			} else {
-				Fs.ReadExactly(buf, 1);
-				e = prev + (int(buf[0]) << 4);
-			}
-			bAlignPos = !bAlignPos;
-			break;
-		case FatKind::Fat16:
-			Fs.ReadExactly(buf, 2);
-			e = load_little_u16(buf);
-			break;
-		case FatKind::Fat32:
-			Fs.ReadExactly(buf, 4);
-			e = load_little_u32(buf) & 0xFFFFFFF;
-			break;
+void FreeClusterMap::Insert(uint32_t start, uint32_t len) {
+	byStart_[start] = len;
+	byLength_.insert(make_pair(len, start));
+}
+
+void FreeClusterMap::Erase(map<uint32_t, uint32_t>::iterator it) {
+	byLength_.erase(make_pair(it->second, it->first));
+	byStart_.erase(it);
+}
+
+void FreeClusterMap::Build(const vector<uint32_t>& fat, uint32_t first, uint32_t end) {
+	byStart_.clear();
+	byLength_.clear();
+	count_ = 0;
+	end = min(end, (uint32_t)fat.size());
+	for (uint32_t c = first; c < end;) {
+		if (fat[c]) {
+			++c;
+			continue;
 		}
-		Fat.push_back(e);
+		auto start = c;
+		while (c < end && !fat[c])
+			++c;
+		Insert(start, c - start);
+		count_ += c - start;
 	}
 }
 
-void FatVolume::SaveFats() {
+void FreeClusterMap::Take(uint32_t cluster) {
+	auto it = byStart_.upper_bound(cluster);
+	if (it == byStart_.begin() || cluster >= prev(it)->first + prev(it)->second)
+		return;														// Already used
+	--it;
+	auto start = it->first
+		, len = it->second;
+	Erase(it);
+	if (cluster > start)
+		Insert(start, cluster - start);
+	if (cluster + 1 < start + len)
+		Insert(cluster + 1, start + len - cluster - 1);
+	--count_;
+}
+
+void FreeClusterMap::Release(uint32_t cluster) {
+	auto next = byStart_.upper_bound(cluster);
+	auto start = cluster;
+	uint32_t len = 1;
+	if (next != byStart_.begin()) {
+		auto it = prev(next);
+		if (cluster < it->first + it->second)
+			return;														// Already free
+		if (it->first + it->second == cluster) {
+			start = it->first;
+			len += it->second;
+			Erase(it);
+		}
+	}
+	if (next != byStart_.end() && next->first == cluster + 1) {
+		len += next->second;
+		Erase(next);
+	}
+	Insert(start, len);
+	++count_;
+}
+
+vector<uint32_t> FreeClusterMap::Allocate(uint32_t n) const {
+	if (n > count_)
+		Throw(errc::no_space_on_device);
+	vector<uint32_t> r;
+	r.reserve(n);
+	auto it = byLength_.lower_bound(make_pair(n, (uint32_t)0));
+	if (it != byLength_.end()) {
+		for (uint32_t i = 0; i < n; ++i)
+			r.push_back(it->second + i);
+	} else {
+		for (auto& run : byStart_)
+			for (uint32_t i = 0; i < run.second && r.size() < n; ++i)
+				r.push_back(run.first + i);
+	}
+	return r;
+}
+
+void FatVolume::SaveMetadata(Stream& stm) {
+	uint32_t n = (uint32_t)Fat.size();
+	stm.WriteBuffer(&n, sizeof n);
+	stm.WriteBuffer(Fat.data(), n * sizeof(uint32_t));
+}
+
+void FatVolume::LoadMetadata(const Stream& stm) {
+	uint32_t n;
+	stm.ReadExactly(&n, sizeof n);
+	if (n != uint32_t(SectorsPerFat * BytesPerSector * 8 / BitsPerFatEntry()))
+		Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+	Fat.resize(n);
+	stm.ReadExactly(Fat.data(), n * sizeof(uint32_t));
+	FreeClusters.Build(Fat, 2, EndCluster);
+	DirtyFatSectors.clear();
+	ChainRuns.clear();
+}
+
+// FAT12 packs two entries into 3 bytes. One 64-bit load yields 4 entries, the tail is unpacked pairwise.
+static void UnpackFat12(const uint8_t* p, size_t size, uint32_t* fat, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n && i / 2 * 3 + 8 <= size; i += 4) {
+		uint64_t v = load_little_u64(p + i / 2 * 3);
+		fat[i] = uint32_t(v & 0xFFF);
+		fat[i + 1] = uint32_t((v >> 12) & 0xFFF);
+		fat[i + 2] = uint32_t((v >> 24) & 0xFFF);
+		fat[i + 3] = uint32_t((v >> 36) & 0xFFF);
+	}
+	for (; i < n; ++i) {
+		auto q = p + i / 2 * 3;
+		fat[i] = i & 1 ? load_little_u16(q + 1) >> 4 : load_little_u16(q) & 0xFFF;
+	}
+}
+
+// Branch-free loops, so the compiler vectorizes them
+static void UnpackFat16(const uint8_t* p, uint32_t* fat, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		fat[i] = load_little_u16(p + i * 2);
+}
+
+static void UnpackFat32(const uint8_t* p, uint32_t* fat, size_t n) {
+	memcpy(fat, p, n * sizeof(uint32_t));							// Windows targets are little-endian
+	for (size_t i = 0; i < n; ++i)
+		fat[i] &= 0xFFFFFFF;
+}
+
+void FatVolume::LoadFat() {
 	auto bytesPerFat = SectorsPerFat * BytesPerSector;
-	if (bytesPerFat > SIZE_MAX)
-		Throw(errc::not_enough_memory);
-	vector<uint8_t> buf((size_t)bytesPerFat);
-	if (Kind == FatKind::Fat32) {										// Pre-read FAT32 to keep high 4 bits of FAT items
-		Fs.Position = (uint32_t)ReservedSectors * BytesPerSector;
-		Fs.ReadExactly(buf.data(), buf.size());
+	auto fat = ReadView((uint32_t)ReservedSectors * BytesPerSector, (size_t)bytesPerFat);
+	uint32_t n = uint32_t(bytesPerFat * 8 / BitsPerFatEntry());
+	Fat.resize(n);
+	switch (Kind) {
+	case FatKind::Fat12: UnpackFat12(fat.data(), fat.size(), Fat.data(), n); break;
+	case FatKind::Fat16: UnpackFat16(fat.data(), Fat.data(), n); break;
+	case FatKind::Fat32: UnpackFat32(fat.data(), Fat.data(), n); break;
 	}
+	FreeClusters.Build(Fat, 2, EndCluster);
+	DirtyFatSectors.clear();
+	ChainRuns.clear();
+}
 
-	uint8_t *p = buf.data();
-	uint8_t t = 0;
-	bool bOdd = false;
-	for (auto x : Fat) {
+// Re-encodes all entries overlapping the sector. p holds its current on-disk contents.
+void FatVolume::EncodeFatSector(uint32_t sector, uint8_t* p) {
+	auto bits = BitsPerFatEntry();
+	uint64_t base = uint64_t(sector) * BytesPerSector
+		, end = base + BytesPerSector;
+	auto put = [&](uint64_t off, uint8_t mask, uint8_t v) {
+		if (off >= base && off < end)
+			p[off - base] = (p[off - base] & ~mask) | (v & mask);
+	};
+	auto last = (uint32_t)min((uint64_t)Fat.size(), (end * 8 + bits - 1) / bits);
+	for (auto i = uint32_t(base * 8 / bits); i < last; ++i) {
+		auto x = Fat[i];
+		uint64_t off = uint64_t(i) * bits / 8;
 		switch (Kind) {
 		case FatKind::Fat12:
-			if (bOdd) {
-				*p++ = t | (uint8_t(x & 0xF) << 4);
-				*p++ = uint8_t(x >> 4);
+			if (i & 1) {
+				put(off, 0xF0, uint8_t(x << 4));
+				put(off + 1, 0xFF, uint8_t(x >> 4));
 			} else {
-				*p++ = (uint8_t)x;
-				t = uint8_t(x >> 8);
+				put(off, 0xFF, (uint8_t)x);
+				put(off + 1, 0x0F, uint8_t(x >> 8));
 			}
-			bOdd = !bOdd;
 			break;
 		case FatKind::Fat16:
-			store_little_u16(p, (uint16_t)x);
-			p += 2;
+			store_little_u16(p + (off - base), (uint16_t)x);
 			break;
-		case FatKind::Fat32:
-			store_little_u16(p, load_little_u32(p) & 0xF0000000 | x);
-			p += 4;
+		case FatKind::Fat32:											// Keep high 4 bits of FAT items
+			store_little_u32(p + (off - base), load_little_u32(p + (off - base)) & 0xF0000000 | x);
 			break;
 		}
 	}
-	if (bOdd)
-		*p = t;
+}
 
-	for (int i = 0; i < NumberOfFats; ++i)
-		Fs.Write((ReservedSectors + SectorsPerFat * i) * BytesPerSector, buf);
+// Writes only sectors changed by SetFat(), each run of adjacent sectors with one write per FAT copy
+void FatVolume::SaveFats() {
+	vector<uint8_t> buf;
+	for (auto it = DirtyFatSectors.begin(); it != DirtyFatSectors.end();) {
+		auto first = *it;
+		uint32_t n = 0;
+		for (; it != DirtyFatSectors.end() && *it == first + n; ++it)
+			++n;
+		buf.resize(size_t(n) * BytesPerSector);
+		auto off = (ReservedSectors + uint64_t(first)) * BytesPerSector;
+		ReadAt(off, buf.data(), buf.size());
+		for (uint32_t i = 0; i < n; ++i)
+			EncodeFatSector(first + i, buf.data() + size_t(i) * BytesPerSector);
+		for (int i = 0; i < NumberOfFats; ++i)
+			WriteAt(off + SectorsPerFat * i * BytesPerSector, buf);
+	}
+	DirtyFatSectors.clear();
 }
 
 DateTime FatVolume::LoadCreationTime(const uint8_t p[32]) {
@@ -148,31 +264,28 @@ static uint8_t ShortFilenameChecksum(const uint8_t shortFilename[11]) {
 }
 
 String FatVolume::DecodeFilename(Span s) {
-	auto fn = GetFilenamePart(s.subspan(0, s.size() - 3));
-	auto ext = GetFilenamePart(s.subspan(s.size() - 3, 3));
-	if (!ext.empty())
-		fn += "." + ext;
-	return fn;
+	return GetFilename(s.subspan(0, s.size() - 3), s.subspan(s.size() - 3, 3));
 }
 
-vector<DirEntry> FatVolume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
-	vector<uint8_t> dirSegment(cluster ? (uint32_t)SectorsPerCluster * BytesPerSector : CurDirEntries * EntrySize);
-	vector<DirEntry> r;
+bool FatVolume::EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) {
+	auto timer = Stats.Time(VolumeOp::GetDirEntries);
+	auto nEntries = DirEntriesCount(cluster);
+	auto runs = cluster ? GetChainRuns(cluster) : vector<ClusterRun>();		// Copy: f may change the FAT
+	auto nextRun = runs.begin();
+	vector<uint8_t> dirSegment(cluster ? 0 : nEntries * EntrySize);
 	auto p = dirSegment.data() + dirSegment.size();
-	auto curCluster = cluster;
 	uint64_t curSegmentOffset = 0;
 	String longName = "";
 	uint8_t prevOrd;
 	uint8_t cksum;
-	for (int i = 0; i < CurDirEntries; ++i, p += 32) {
+	for (uint32_t i = 0; i < nEntries; ++i, p += 32) {
 		if (p >= dirSegment.data() + dirSegment.size()) {
-			if (curCluster) {
-				curSegmentOffset = CalcDataOffset(curCluster);
-				curCluster = Fat[curCluster];
+			if (cluster) {											// Whole run with one read
+				dirSegment.resize(size_t(nextRun->Count) * SectorsPerCluster * BytesPerSector);
+				curSegmentOffset = CalcDataOffset((nextRun++)->Start);
 			} else
 				curSegmentOffset = GetFirstRootDirSector() * BytesPerSector;
-			Fs.Position = curSegmentOffset;
-			Fs.ReadExactly(dirSegment.data(), dirSegment.size());
+			ReadAt(curSegmentOffset, dirSegment.data(), dirSegment.size());
 			p = dirSegment.data();
 		}
 		if (!p[0])
@@ -185,7 +298,8 @@ vector<DirEntry> FatVolume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
 				entryEmpty.OriginalFilenamePresentation = Blob(p, 11);
 				entryEmpty.FileName = "~" + DecodeFilename(Span(entryEmpty.OriginalFilenamePresentation).subspan(1));
 				ReadDirEntry(entryEmpty, p);
-				r.push_back(entryEmpty);
+				if (!f(entryEmpty))
+					return false;
 			}
 			break;
 		case 0x05:
@@ -241,26 +355,60 @@ vector<DirEntry> FatVolume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
 					break;
 				entry.DirEntryDiskOffset = p - dirSegment.data() + curSegmentOffset;
 				ReadDirEntry(entry, p);
-				r.push_back(entry);
+				if (!f(entry))
+					return false;
 			}
 		}
 	}
-	return r;
+	return true;
+}
+
+const vector<ClusterRun>& FatVolume::GetChainRuns(uint32_t cluster) {
+	auto it = ChainRuns.find(cluster);
+	if (it != ChainRuns.end())
+		return it->second;
+	vector<ClusterRun> r;
+	uint32_t n = 0;
+	for (auto c = cluster; c < MinFinalCluster; c = Fat[c], ++n) {
+		if (c < 2 || c >= Fat.size() || n >= Fat.size())			// Out of range or loop in the chain
+			Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+		if (!r.empty() && r.back().Start + r.back().Count == c)
+			++r.back().Count;
+		else
+			r.push_back(ClusterRun{ n, c, 1 });
+	}
+	return ChainRuns.emplace(cluster, move(r)).first->second;
 }
 
 vector<uint32_t> FatVolume::GetClusters(uint32_t cluster) {
 	vector<uint32_t> r;
 	if (cluster)
-		for (; cluster < MinFinalCluster; cluster = Fat[MinFinalCluster])
-			r.push_back(cluster);
+		for (auto& run : GetChainRuns(cluster))
+			for (uint32_t i = 0; i < run.Count; ++i)
+				r.push_back(run.Start + i);
 	return r;
 }
 
+void FatVolume::SetFat(uint32_t cluster, uint32_t next) {
+	auto& e = Fat.at(cluster);
+	if (e == next)
+		return;
+	if (!e != !next && cluster >= 2 && cluster < EndCluster)
+		next ? FreeClusters.Take(cluster) : FreeClusters.Release(cluster);
+	e = next;
+	ChainRuns.clear();
+	auto bits = BitsPerFatEntry();
+	auto first = uint64_t(cluster) * bits / 8 / BytesPerSector
+		, last = ((uint64_t(cluster) + 1) * bits - 1) / 8 / BytesPerSector;
+	for (auto sector = first; sector <= last; ++sector)
+		DirtyFatSectors.insert((uint32_t)sector);
+}
+
 void FatVolume::CreateChain(const vector<uint32_t>& clusters) {
-	for (uint32_t i = 0; i < clusters.size() - 1; ++i)
-		Fat[clusters[i]] = clusters[i + 1];
+	for (size_t i = 1; i < clusters.size(); ++i)
+		SetFat(clusters[i - 1], clusters[i]);
 	if (!clusters.empty())
-		Fat[clusters.back()] = MinFinalCluster;
+		SetFat(clusters.back(), MinFinalCluster);
 }
 
 uint32_t FatVolume::SaveStreamContents(Stream& istm, uint32_t cluster) {
@@ -271,19 +419,23 @@ uint32_t FatVolume::SaveStreamContents(Stream& istm, uint32_t cluster) {
 	if (cluster) {
 		clusters = GetClusters(cluster);
 		while (clusters.size() > needClusters) {
-			Fat[clusters.back()] = 0;
+			SetFat(clusters.back(), 0);
 			clusters.pop_back();
 			if (!clusters.empty())
-				Fat[clusters.back()] = MinFinalCluster;
+				SetFat(clusters.back(), MinFinalCluster);
 		}
-	} else
-		clusters = Allocate(len);
+	}
+	if (clusters.size() < needClusters) {
+		auto added = Allocate((needClusters - clusters.size()) * bytesPerCluster);
+		clusters.insert(clusters.end(), added.begin(), added.end());
+		CreateChain(clusters);
+	}
 
 	vector<uint8_t> buf(bytesPerCluster);
 	for (auto c : clusters) {
 		memset(buf.data(), 0, buf.size());
 		auto sz = istm.Read(buf.data(), buf.size());
-		Fs.Write(CalcDataOffset(c), Span(buf.data(), buf.size()));
+		WriteAt(CalcDataOffset(c), Span(buf.data(), buf.size()));
 	}
 
 	return clusters.empty() ? 0 : clusters.front();
@@ -294,10 +446,8 @@ void FatVolume::SaveDirStreamToVolume(Stream& stm) {
 		SaveStreamContents(stm, CurDirCluster);
 	else if (stm.Length > RootDirectoryEntries * EntrySize)
 		Throw(HRESULT_FROM_WIN32(ERROR_CANNOT_MAKE));
-	else {
-		Fs.Position = GetFirstRootDirSector() * BytesPerSector;
-		stm.CopyTo(Fs);
-	}
+	else
+		WriteAt(GetFirstRootDirSector() * BytesPerSector, stm);
 }
 
 void FatVolume::Serialize(Stream& stm, const DirEntry& e) {
@@ -362,7 +512,7 @@ void FatVolume::Serialize(Stream& stm, const DirEntry& e) {
 }
 
 void FatVolume::LoadCurDir() {
-	Files = GetDirEntries(CurDirCluster, false);
+	Files = ListDirectory(CurDirCluster);
 	for (auto it = Files.begin(); it != Files.end();) {
 		it = it->IsVolumeLabel
 			? Files.erase(it)
@@ -397,36 +547,37 @@ LAB_ADDED:
 }
 
 int64_t FatVolume::FreeSpace() {
-	int64_t r = 0;
-	for (auto e : Fat)
-		if (!e)
-			r += (uint32_t)SectorsPerCluster * BytesPerSector;
-	return r;
+	return int64_t(FreeClusters.Count()) * SectorsPerCluster * BytesPerSector;
 }
 
 void FatVolume::RemoveFile(RCString filename) {
+	auto timer = Stats.Time(VolumeOp::RemoveFile);
 	RemoveFileChecks(filename);
 	auto& e = *GetEntry(filename);
 
-	for (uint32_t cluster = (uint32_t)e.FirstCluster; cluster < MinFinalCluster;)
-		cluster = exchange(Fat.at(cluster), (uint32_t)0);
+	for (uint32_t cluster = (uint32_t)e.FirstCluster; cluster && cluster < MinFinalCluster;) {
+		auto next = Fat.at(cluster);
+		SetFat(cluster, 0);
+		cluster = next;
+	}
 
 	uint8_t deleteMark[1] = { 0xE5 }
 		, zero[2] = { 0, 0 };
-	Fs.Write(e.DirEntryDiskOffset, deleteMark);		// Mark as deleted
-	Fs.Write(e.DirEntryDiskOffset + 20, zero);		// .FirstCluster = 0
-	Fs.Write(e.DirEntryDiskOffset + 26, zero);
+	WriteAt(e.DirEntryDiskOffset, deleteMark);		// Mark as deleted
+	WriteAt(e.DirEntryDiskOffset + 20, zero);		// .FirstCluster = 0
+	WriteAt(e.DirEntryDiskOffset + 26, zero);
 
 	LoadCurDir();
 	SaveFats();
 }
 
 void FatVolume::Init(const path& filepath) {
+	auto timer = Stats.Time(VolumeOp::Init);
 	base::Init(filepath);
 
 	array<uint8_t, 512> buf;
 	auto data = buf.data();
-	Fs.ReadExactly(buf.data(), buf.size());
+	ReadAt(0, buf.data(), buf.size());
 	auto bpb = buf.data() + 11;
 	BytesPerSector = load_little_u16(data + 11);
 	SectorsPerCluster = data[13];
@@ -464,27 +615,79 @@ void FatVolume::Init(const path& filepath) {
 		: Kind == FatKind::Fat16 ? 0xFFF8
 		: 0xFFFFFF8;
 	FinalCluster = MinFinalCluster | 0xF;
+	EndCluster = uint32_t(clusters + 2);
 
+	if (!RestoreMetadata())
+		LoadFat();
 	CurDirCluster = RootCluster;
-	CurDirEntries = RootDirectoryEntries;
 
 	LoadCurDir();
-	LoadFat();
-}
-
-void FatVolume::CopyFileTo(const DirEntry& fileEntry, Stream& os) {
-	if (uint32_t c = (uint32_t)fileEntry.FirstCluster) {
-		vector<byte> buf(uint32_t(SectorsPerCluster) * BytesPerSector);
-		for (int64_t len = (int64_t)fileEntry.Length; len > 0; c = Fat[c], len -= buf.size()) {
-			if (c >= MinFinalCluster)
-				Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
-			Fs.Position = CalcDataOffset(c);
-			Fs.ReadExactly(buf.data(), buf.size());
-			os.WriteBuffer(buf.data(), (size_t)std::min((int64_t)buf.size(), len));
-		}
-		if (c < MinFinalCluster)
+}
+
+uint32_t FatVolume::DirEntriesCount(uint32_t cluster) {
+	if (!cluster)
+		return RootDirectoryEntries;
+	auto& runs = GetChainRuns(cluster);
+	uint32_t nClusters = runs.empty() ? 0 : runs.back().Index + runs.back().Count;
+	return nClusters * (uint32_t(SectorsPerCluster) * BytesPerSector / EntrySize);
+}
+
+vector<Extent> FatVolume::GetFileExtents(const DirEntry& entry) {
+	vector<Extent> r;
+	if (auto c = (uint32_t)entry.FirstCluster) {
+		uint64_t bytesPerCluster = uint32_t(SectorsPerCluster) * BytesPerSector;
+		auto& runs = GetChainRuns(c);
+		uint64_t nClusters = runs.empty() ? 0 : runs.back().Index + runs.back().Count;
+		if (nClusters != (entry.Length + bytesPerCluster - 1) / bytesPerCluster)		// Chain does not match the length
 			Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+		for (auto& run : runs)
+			r.push_back(Extent{ CalcDataSector(run.Start), uint64_t(run.Count) * SectorsPerCluster });
+	}
+	return r;
+}
+
+unique_ptr<Stream> FatVolume::OpenFile(const DirEntry& fileEntry) {
+	if (Compressed || _openedForModifying || InOverlay())				// No private handle, or the contents may change under the stream
+		return base::OpenFile(fileEntry);
+	GetFileExtents(fileEntry);											// Validates the chain against the length
+	return make_unique<FatFileStream>(*this, fileEntry);
+}
+
+FatFileStream::FatFileStream(FatVolume& volume, const DirEntry& entry)
+	: length_(entry.Length)
+{
+	MemoryStream ms;
+	volume.WriteFilePrefix(entry, ms);
+	prefix_ = Blob(ms.AsSpan());
+	if (auto c = (uint32_t)entry.FirstCluster) {
+		uint64_t bytesPerCluster = uint32_t(volume.SectorsPerCluster) * volume.BytesPerSector;
+		for (auto& run : volume.GetChainRuns(c))
+			pieces_.push_back(Piece{ run.Index * bytesPerCluster, volume.CalcDataOffset(run.Start), run.Count * bytesPerCluster });
+	}
+	fs_.Open(volume.filepath_, FileMode::Open, FileAccess::Read, FileShare::ReadWrite);
+}
+
+size_t FatFileStream::Read(void* buf, size_t count) const {
+	auto p = (uint8_t*)buf;
+	size_t r = 0;
+	if (pos_ < prefix_.size()) {
+		r = (size_t)min((uint64_t)count, prefix_.size() - pos_);
+		memcpy(p, prefix_.constData() + pos_, r);
+		pos_ += r;
+	}
+	while (r < count && pos_ < get_Length()) {
+		auto off = pos_ - prefix_.size();
+		auto it = upper_bound(pieces_.begin(), pieces_.end(), off, [](uint64_t o, const Piece& piece) { return o < piece.Offset; });
+		if (it == pieces_.begin() || off - prev(it)->Offset >= prev(it)->Length)
+			Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+		auto& piece = *prev(it);
+		auto cb = (size_t)min(min((uint64_t)count - r, piece.Length - (off - piece.Offset)), length_ - off);
+		fs_.Position = piece.ImageOffset + (off - piece.Offset);
+		fs_.ReadExactly(p + r, cb);
+		r += cb;
+		pos_ += cb;
 	}
+	return r;
 }
 
 void FatVolume::ChangeDirectory(RCString name) {
@@ -497,7 +700,7 @@ void FatVolume::ChangeDirectory(RCString name) {
 		CurDirName = name;
 	}
 	else if (CurDirCluster != RootCluster) {
-		for (auto& e : GetDirEntries(CurDirCluster, true))
+		for (auto& e : ListDirectory(CurDirCluster, true))
 			if (e.FileName == "..") {
 				CurDirCluster = (uint32_t)e.FirstCluster;
 				CurDirName = CurDirCluster == RootCluster ? nullptr : "..";
@@ -506,31 +709,18 @@ void FatVolume::ChangeDirectory(RCString name) {
 		CurDirCluster = RootCluster;
 	}
 LAB_FOUND:
-	if (!CurDirCluster)
-		CurDirEntries = RootDirectoryEntries;
-	else {
-		CurDirEntries = 0;
-		for (auto c = CurDirCluster; c < MinFinalCluster; c = Fat.at(c))
-			CurDirEntries += uint32_t(SectorsPerCluster) * BytesPerSector / 32;
-	}
 	LoadCurDir();
 }
 
 vector<uint32_t> FatVolume::Allocate(int64_t size) {
-	vector<uint32_t> r;
 	if (size <= 0)
-		return r;
+		return vector<uint32_t>();
 	uint32_t bytesInCluster = (uint32_t)SectorsPerCluster * BytesPerSector;
-	for (uint32_t i = 0; Fat.size(); ++i)
-		if (!Fat[i]) {
-			r.push_back(i);
-			if ((size -= bytesInCluster) <= 0)
-				return r;
-		}
-	Throw(errc::no_space_on_device);
+	return FreeClusters.Allocate(uint32_t((size + bytesInCluster - 1) / bytesInCluster));
 }
 
 void FatVolume::ModifyFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) {
+	auto timer = Stats.Time(VolumeOp::ModifyFile);
 	EnsureWriteMode();
 	auto it = FindEntry(filename);
 	if (it != Files.end()) {
@@ -539,9 +729,9 @@ void FatVolume::ModifyFile(const String& filename, uint64_t len, Stream& istm, c
 		uint8_t buf[4];
 		len = AdjustLengthOnPut(istm, *it, len);
 		store_little_u32(buf, SaveStreamContents(istm, (uint32_t)it->FirstCluster));
-		Fs.Write(it->DirEntryDiskOffset + 26, Span(buf, 2));
+		WriteAt(it->DirEntryDiskOffset + 26, Span(buf, 2));
 		if (Kind == FatKind::Fat32)
-			Fs.Write(it->DirEntryDiskOffset + 20, Span(buf + 2, 2));
+			WriteAt(it->DirEntryDiskOffset + 20, Span(buf + 2, 2));
 	} else {
 		DirEntry e = AllocateFileEntry();
 		len = AdjustLengthOnPut(istm, e, len);
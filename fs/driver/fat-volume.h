@@ -19,8 +19,62 @@ struct FatDateTime {
 	static FatDateTime Clamp(const DateTime& dt);
 };
 
+// Contiguous piece of a cluster chain
+struct ClusterRun {
+	uint32_t Index;													// Position of Start in the chain
+	uint32_t Start, Count;
+};
+
+// Free clusters as runs, indexed by start for coalescing and by length for best-fit allocation.
+// Kept in sync with the FAT by FatVolume::SetFat().
+class FreeClusterMap {
+public:
+	uint32_t Count() const { return count_; }
+
+	void Build(const vector<uint32_t>& fat, uint32_t first, uint32_t end);
+	void Take(uint32_t cluster);
+	void Release(uint32_t cluster);
+
+	// Smallest run that fits n clusters, otherwise runs in disk order. Does not mark clusters as used.
+	vector<uint32_t> Allocate(uint32_t n) const;
+private:
+	map<uint32_t, uint32_t> byStart_;									// start -> length
+	set<pair<uint32_t, uint32_t>> byLength_;							// (length, start)
+	uint32_t count_ = 0;
+
+	void Insert(uint32_t start, uint32_t len);
+	void Erase(map<uint32_t, uint32_t>::iterator it);
+};
+
+class FatVolume;
+
+// Reads the file straight from the image, touching only the clusters at the current position.
+// The cluster runs are captured at open and reads go through a private handle, so the stream shares no state
+// with the volume and may be read on another thread
+class FatFileStream : public Stream {
+public:
+	FatFileStream(FatVolume& volume, const DirEntry& entry);
+
+	uint64_t get_Length() const override { return prefix_.size() + length_; }
+	uint64_t get_Position() const override { return pos_; }
+	void put_Position(uint64_t pos) const override { pos_ = pos; }
+	bool Eof() const override { return pos_ >= get_Length(); }
+	size_t Read(void* buf, size_t count) const override;
+private:
+	struct Piece {
+		uint64_t Offset, ImageOffset, Length;						// Offset in the file contents
+	};
+
+	FileStream fs_;
+	vector<Piece> pieces_;
+	Blob prefix_;													// From WriteFilePrefix()
+	uint64_t length_;
+	mutable uint64_t pos_ = 0;
+};
+
 class FatVolume : public Volume {
 	typedef Volume base;
+	friend class FatFileStream;
 public:
 	static const size_t EntrySize = 32;
 	static const int LongNameCharsPerEntry = 13;
@@ -46,10 +100,14 @@ private:
 		, PhysicalDriveNumber
 		, BpbFlags;
 
-	int CurDirCluster, CurDirEntries;
+	int CurDirCluster;
 
-	uint32_t FinalCluster, MinFinalCluster;
+	uint32_t FinalCluster, MinFinalCluster
+		, EndCluster;													// One past the last data cluster
 	vector<uint32_t> Fat;
+	FreeClusterMap FreeClusters;
+	set<uint32_t> DirtyFatSectors;									// Relative to the FAT start
+	unordered_map<uint32_t, vector<ClusterRun>> ChainRuns;			// By first cluster, dropped on any FAT change
 
 	void Init(const path& filepath) override;
 	int64_t FreeSpace() override;
@@ -57,7 +115,12 @@ private:
 	CFiles::iterator FatVolume::FindFile(const String& filename);
 	void RemoveFile(RCString filename) override;
 	int MaxNameLength() override { return 255; }
+	int BitsPerFatEntry() const { return Kind == FatKind::Fat32 ? 32 : Kind == FatKind::Fat16 ? 16 : 12; }
 	void LoadFat();
+	void ReloadMetadata() override { LoadFat(); base::ReloadMetadata(); }
+	void SaveMetadata(Stream& stm) override;
+	void LoadMetadata(const Stream& stm) override;
+	void EncodeFatSector(uint32_t sector, uint8_t* p);
 	void SaveFats();
 	void ChangeDirectory(RCString name) override;
 
@@ -73,6 +136,9 @@ private:
 		return CalcDataSector(cluster) * BytesPerSector;
 	}
 
+	// Capacity of the directory in entries
+	uint32_t DirEntriesCount(uint32_t cluster);
+
 	uint64_t GetFirstRootDirSector() {
 		return ReservedSectors + NumberOfFats * SectorsPerFat;
 	}
@@ -82,13 +148,17 @@ protected:
 	virtual DirEntry AllocateDirectory();
 	virtual DateTime LoadCreationTime(const uint8_t p[32]);
 	virtual void ReadDirEntry(DirEntry& e, const uint8_t p[32]);
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override;
+	bool EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) override;
 	void Serialize(Stream& stm, const DirEntry& entry) override;
-	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override;
+	vector<Extent> GetFileExtents(const DirEntry& entry) override;
+	unique_ptr<Stream> OpenFile(const DirEntry& fileEntry) override;
 
 	uint64_t FindFreeContiguousArea(uint64_t nClusters) { Throw(E_NOTIMPL); }
 	void LoadCurDir() override;
+	uint32_t RootDirectoryId() override { return RootCluster; }
+	const vector<ClusterRun>& GetChainRuns(uint32_t cluster);
 	vector<uint32_t> GetClusters(uint32_t cluster);
+	void SetFat(uint32_t cluster, uint32_t next);
 	void CreateChain(const vector<uint32_t>& clusters);
 
 	// If firstCluster == 0: allocate from scratch
@@ -42,20 +42,20 @@ void Files11ods1Volume::LoadHomeBlock(const uint8_t home[512]) {
 }
 
 void Files11ods1Volume::Init(const path& filepath) {
+	auto timer = Stats.Time(VolumeOp::Init);
 	base::Init(filepath);
 
 	uint8_t home[512];
-	Fs.Position = 512;
-	Fs.ReadExactly(home, 512);
+	ReadAt(512, home, 512);
 	LoadHomeBlock(home);
 
-	LoadAllDirEntries();
-	Files = GetDirEntries(FileNumMFD, 0);
+	if (!RestoreMetadata())
+		LoadAllDirEntries();
+	TRC(1, AllDirEntries.size() << " file headers, " << AllDirEntries.MemoryUsage() << " bytes");
+	Files = ListDirectory(FileNumMFD);
 }
 
-bool Files11ods1Volume::ReadHeaderSector(uint32_t sector, uint8_t data[512]) {
-	Fs.Position = sector * 512;
-	Fs.ReadExactly(data, 512);
+bool Files11ods1Volume::CheckHeaderSector(const uint8_t data[512]) {
 	uint16_t sum = 0;
 	for (int i = 0; i < 255; ++i)
 		sum += load_little_u16(data + i * 2);
@@ -67,12 +67,13 @@ bool Files11ods1Volume::ReadHeaderSector(uint32_t sector, uint8_t data[512]) {
 }
 
 String Files11ods1Volume::DecodeFileNameVer(const uint8_t d[10]) {
-	String fn = (DecodeRadix50(load_little_u16(d)) + DecodeRadix50(load_little_u16(d + 2)) + DecodeRadix50(load_little_u16(d + 4))).Trim()
-		+ "." + DecodeRadix50(load_little_u16(d + 6)).Trim();
-	uint16_t ver = load_little_u16(d + 8);
-	return ver > 1
-		? fn + ";" + String(to_string(ver))
-		: fn;
+	return Names.Intern(NameKind::Files11, Span(d, 10), [this](RCSpan raw) {
+		String fn = GetRadix50Filename(raw.data(), 3);
+		uint16_t ver = load_little_u16(raw.data() + 8);
+		return ver > 1
+			? fn + ";" + String(to_string(ver))
+			: fn;
+	});
 }
 
 void Files11ods1Volume::LoadFileHeader(int sector, const uint8_t data[512]) {
@@ -90,35 +91,82 @@ void Files11ods1Volume::LoadFileHeader(int sector, const uint8_t data[512]) {
 	if (*revDatetime)
 		e.LastWriteTime = ParseFiles11DateTime(revDatetime);
 	e.CreationTime = ParseFiles11DateTime((const char*)ident + 25);
-	e.Length = (int64_t)GetFileSectors(e).size() * BytesPerSector;
+	e.Length = (int64_t)CountMappedSectors(data) * BytesPerSector;
 
-	if (!AllDirEntries.insert(make_pair(fnum, e)).second)
+	AddHeaderEntry(fnum, e);
+}
+
+void Files11ods1Volume::ClearHeaderEntries() {
+	AllDirEntries.clear();
+	AllDirEntries.reserve(MaxNumberOfFiles);
+	FileNumRows.assign((size_t)MaxNumberOfFiles + 1, DirTable::npos);
+}
+
+void Files11ods1Volume::AddHeaderEntry(uint16_t fileNum, const DirEntry& e) {
+	if (fileNum >= FileNumRows.size())
+		FileNumRows.resize((size_t)fileNum + 1, DirTable::npos);
+	auto& row = FileNumRows[fileNum];
+	if (row != DirTable::npos)
 		Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+	row = AllDirEntries.Add(e);
 }
 
 void Files11ods1Volume::LoadAllDirEntries() {
-	AllDirEntries.clear();
-	for (int i = 0; i < MaxNumberOfFiles; ++i) {
-		uint8_t data[512];
-		auto sector = BitmapLba + SectorsInBitmap + i;
-		if (ReadHeaderSector(sector, data))
-			LoadFileHeader(sector, data);
+	ClearHeaderEntries();
+	auto firstSector = BitmapLba + SectorsInBitmap;
+	auto headers = ReadView((uint64_t)firstSector * 512, (size_t)MaxNumberOfFiles * 512);		// Initial headers of the Index file are contiguous
+	for (uint32_t i = 0; i < MaxNumberOfFiles; ++i) {
+		auto data = headers.data() + i * 512;
+		if (CheckHeaderSector(data))
+			LoadFileHeader(firstSector + i, data);
 	}
 }
 
-const DirEntry& Files11ods1Volume::GetEntryByFileId(uint32_t fileId) {
+void Files11ods1Volume::SaveMetadata(Stream& stm) {
+	AllDirEntries.Save(stm);
+	uint32_t n = (uint32_t)FileNumRows.size();
+	stm.WriteBuffer(&n, sizeof n);
+	stm.WriteBuffer(FileNumRows.data(), n * sizeof(DirTable::Index));
+}
+
+void Files11ods1Volume::LoadMetadata(const Stream& stm) {
+	AllDirEntries.Load(stm);
+	uint32_t n;
+	stm.ReadExactly(&n, sizeof n);
+	if (n > max((size_t)MaxNumberOfFiles + 1, (size_t)0x10000))	// ClearHeaderEntries() sizes it by the 32-bit ODS-2 home block field
+		Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+	FileNumRows.resize(n);
+	stm.ReadExactly(FileNumRows.data(), n * sizeof(DirTable::Index));
+	for (auto row : FileNumRows)
+		if (row != DirTable::npos && row >= AllDirEntries.size())
+			Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+}
+
+DirEntry Files11ods1Volume::GetEntryByFileId(uint32_t fileId) {
 	uint16_t fileNum = (uint16_t)fileId;
-	auto it = AllDirEntries.find(fileNum);
-	if (it != AllDirEntries.end())
-		return it->second;
+	if (fileNum < FileNumRows.size() && FileNumRows[fileNum] != DirTable::npos)
+		return AllDirEntries[FileNumRows[fileNum]];
 	Throw(errc::no_such_file_or_directory);
 }
 
-vector<uint32_t> Files11ods1Volume::GetFileSectors(const DirEntry& e) {
-	vector<uint32_t> r;
-	uint8_t data[512];
-	Fs.Position = e.FirstCluster * BytesPerSector;
-	Fs.ReadExactly(data, 512);
+vector<Extent> Files11ods1Volume::GetFileExtents(const DirEntry& e) {
+	vector<Extent> r;
+	auto header = ReadView(e.FirstCluster * BytesPerSector, 512);
+	ParseMapArea(header.data(), [&r](uint32_t lbn, uint32_t count) {
+		r.push_back(Extent{ lbn, count });
+	});
+	return r;
+}
+
+uint64_t Files11ods1Volume::CountMappedSectors(const uint8_t header[512]) {
+	uint64_t r = 0;
+	ParseMapArea(header, [&r](uint32_t lbn, uint32_t count) {
+		r += count;
+	});
+	return r;
+}
+
+void Files11ods1Volume::ParseMapArea(const uint8_t data[512], const function<void(uint32_t, uint32_t)>& f) {
 	const uint8_t* mapArea = data + data[1] * 2;
 	uint8_t ctsz = mapArea[6], lbsz = mapArea[7];
 	if ((ctsz + lbsz) & 1)
@@ -133,27 +181,23 @@ vector<uint32_t> Files11ods1Volume::GetFileSectors(const DirEntry& e) {
 			lbn = (lbn << 16) | load_little_u16(mapArea + off + 4);
 			break;
 		}
-		for (int i = 0, count = 1 + (ctsz == 1 ? mapArea[off + 1] : load_little_u16(mapArea + off)); i < count; ++i)
-			r.push_back(lbn + i);
+		f(lbn, 1u + (ctsz == 1 ? mapArea[off + 1] : load_little_u16(mapArea + off)));
 	}
-	return r;
 }
 
-void Files11ods1Volume::CopyFileTo(const DirEntry& fileEntry, Stream& os) {
-	auto sectors = GetFileSectors(fileEntry);
-	for (auto sec : sectors) {
-		uint8_t data[512];
-		Fs.Position = (uint64_t)sec * 512;
-		Fs.ReadExactly(data, 512);
-		os.Write(data);
-	}
+vector<uint32_t> Files11ods1Volume::GetFileSectors(const DirEntry& e) {
+	vector<uint32_t> r;
+	for (auto& x : GetFileExtents(e))
+		for (uint64_t i = 0; i < x.Count; ++i)
+			r.push_back(uint32_t(x.Lba + i));
+	return r;
 }
 
-vector<DirEntry> Files11ods1Volume::GetDirEntries(uint32_t fileNum, bool bWithExtra) {
+bool Files11ods1Volume::EnumDirEntries(uint32_t fileNum, bool bWithExtra, const CEnumCallback& f) {
+	auto timer = Stats.Time(VolumeOp::GetDirEntries);
 	MemoryStream ms;
 	CopyFileTo(GetEntryByFileId(fileNum), ms);
 	Span s = ms.AsSpan();
-	vector<DirEntry> r;
 	for (int off = 0; off < s.size(); off += 16) {
 		const uint8_t* p = s.data() + off;
 		uint16_t fn = load_little_u16(p);
@@ -163,11 +207,12 @@ vector<DirEntry> Files11ods1Volume::GetDirEntries(uint32_t fileNum, bool bWithEx
 			if (e.Aux1 != fileNum) {
 				e.AlternateFileName = e.FileName;
 				e.FileName = DecodeFileNameVer(p + 6);
-				r.push_back(e);
+				if (!f(e))
+					return false;
 			}
 		}
 	}
-	return r;
+	return true;
 }
 
 void Files11ods1Volume::ChangeDirectory(RCString name) {
@@ -192,7 +237,7 @@ void Files11ods1Volume::ChangeDirectory(RCString name) {
 		CurPath.push_back(name);
 		CurFidPath.push_back(CurDirFileId);
 	}
-	Files = GetDirEntries(CurDirFileId, false);
+	Files = ListDirectory(CurDirFileId);
 }
 
 int64_t Files11ods1Volume::FreeSpace() {
@@ -39,11 +39,7 @@ class Files11ods2Volume : public Files11ods1Volume {
 		return DateTime(c_file11Epoch.Ticks + load_little_u64(d));
 	}
 
-	vector<uint32_t> GetFileSectors(const DirEntry& e) override {
-		vector<uint32_t> r;
-		uint8_t data[512];
-		Fs.Position = e.FirstCluster * BytesPerSector;
-		Fs.ReadExactly(data, 512);
+	void ParseMapArea(const uint8_t data[512], const function<void(uint32_t, uint32_t)>& f) override {
 		const uint8_t* mapArea = data + data[1] * 2;
 		for (int off = 0, end = data[58] * 2; off < end;) {
 			uint16_t wl = load_little_u16(mapArea + off)
@@ -70,16 +66,13 @@ class Files11ods2Volume : public Files11ods1Volume {
 				off += 8;
 				break;
 			}
-			for (int i = 0; i < count; ++i)
-				r.push_back(lbn + i);
+			f(lbn, count);
 		}
-		return r;
 	}
 
 	void LoadFileHeader(int sector) {
-		uint8_t data[512];
-		Fs.Position = sector * 512;
-		Fs.ReadExactly(data, 512);
+		auto header = ReadView((uint64_t)sector * 512, 512);
+		const uint8_t* data = header.data();
 		uint16_t checksum = load_little_u16(data + 510);
 		uint16_t fnum = load_little_u16(data + 8);
 		uint32_t fcha = load_little_u32(data + 52);
@@ -105,28 +98,27 @@ class Files11ods2Volume : public Files11ods1Volume {
 		e.LastWriteTime = ParseOds2DateTime(ident + 30);
 		e.ExpirationTime = ParseOds2DateTime(ident + 38);
 		e.BackupTime = ParseOds2DateTime(ident + 46);
-		e.Length = (int64_t)GetFileSectors(e).size() * BytesPerSector;
+		e.Length = (int64_t)CountMappedSectors(data) * BytesPerSector;
 
-		if (!AllDirEntries.insert(make_pair(fnum, e)).second)
-			Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+		AddHeaderEntry(fnum, e);
 	}
 
 	void LoadAllDirEntries() override {
-		AllDirEntries.clear();
+		ClearHeaderEntries();
 		int i;
 		for (i = 0; i < (min)((uint32_t)16, MaxNumberOfFiles); ++i)
 			LoadFileHeader(BitmapLba + SectorsInBitmap + i);
-		auto sectors = GetFileSectors(AllDirEntries[FileNumIndex]);
+		auto sectors = GetFileSectors(GetEntryByFileId(FileNumIndex));
 		int off = 4 * SectorsPerCluster + SectorsInBitmap;
 		for (int n = (min)(MaxNumberOfFiles, uint32_t(sectors.size() - off)); i < n; ++i)
 			LoadFileHeader(sectors[off + i]);
 	}
 
-	vector<DirEntry> GetDirEntries(uint32_t fileNum, bool bWithExtra) override {
+	bool EnumDirEntries(uint32_t fileNum, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
 		MemoryStream ms;
 		CopyFileTo(GetEntryByFileId(fileNum), ms);
 		Span s = ms.AsSpan();
-		vector<DirEntry> r;
 		for (int off = 0; off < s.size();) {
 			const uint8_t* p = s.data() + off;
 			uint16_t size = load_little_u16(p);
@@ -152,12 +144,13 @@ class Files11ods2Volume : public Files11ods1Volume {
 				if (e.Aux1 != fileNum) {
 					e.AlternateFileName = e.FileName;
 					e.FileName = fn;
-					r.push_back(e);
+					if (!f(e))
+						return false;
 				}
 			}
 			off += size + 2;
 		}
-		return r;
+		return true;
 	}
 };
 
@@ -15,7 +15,7 @@ class Files11ods1Volume : public Volume {
 	int MaxNameLength() override { return 13; }
 	void Init(const path& filepath) override;
 	String DecodeFileNameVer(const uint8_t d[10]);
-	vector<DirEntry> GetDirEntries(uint32_t fileNum, bool bWithExtra) override;
+	bool EnumDirEntries(uint32_t fileNum, bool bWithExtra, const CEnumCallback& f) override;
 	void ChangeDirectory(RCString name) override;
 	int64_t FreeSpace() override;
 protected:
@@ -29,19 +29,30 @@ protected:
 		FileNumIndex, FileNumStorageBitmap, FileNumBadBlocks, FileNumMFD
 	};
 
-	unordered_map<uint16_t, DirEntry> AllDirEntries;
+	DirTable AllDirEntries;						// All file headers of the volume
+	vector<DirTable::Index> FileNumRows;		// File number -> row of AllDirEntries
 	int CurDirFileId = FileNumMFD;
 	uint32_t MaxNumberOfFiles = 0;
 	uint32_t BitmapLba = 0;
 	uint16_t SectorsInBitmap = 0;
 
-	virtual bool ReadHeaderSector(uint32_t sector, uint8_t data[512]);
+	uint32_t RootDirectoryId() override { return FileNumMFD; }
+	uint32_t SubdirectoryId(const DirEntry& dir) override { return dir.Aux1; }
+	virtual bool CheckHeaderSector(const uint8_t data[512]);
 	virtual void LoadHomeBlock(const uint8_t home[512]);
 	virtual void LoadAllDirEntries();
-	virtual vector<uint32_t> GetFileSectors(const DirEntry& e);
+	void SaveMetadata(Stream& stm) override;
+	void LoadMetadata(const Stream& stm) override;
+	vector<Extent> GetFileExtents(const DirEntry& e) override;
+
+	// Calls f(lbn, count) for each retrieval pointer of the file header
+	virtual void ParseMapArea(const uint8_t header[512], const function<void(uint32_t, uint32_t)>& f);
+	uint64_t CountMappedSectors(const uint8_t header[512]);
+	vector<uint32_t> GetFileSectors(const DirEntry& e);
 	virtual void LoadFileHeader(int sector, const uint8_t data[512]);
-	const DirEntry& GetEntryByFileId(uint32_t fileId);
-	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override;
+	void AddHeaderEntry(uint16_t fileNum, const DirEntry& e);
+	void ClearHeaderEntries();
+	DirEntry GetEntryByFileId(uint32_t fileId);
 };
 
 } // U::FS::
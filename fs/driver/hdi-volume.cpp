@@ -25,10 +25,10 @@ public:
 	}
 protected:
 	void Init(const path& filepath) override {
+		auto timer = Stats.Time(VolumeOp::Init);
 		base::Init(filepath);
 		uint8_t buf[512];
-		Fs.Position = 0;
-		Fs.ReadExactly(buf, 512);
+		ReadAt(0, buf, 512);
 		if (CheckSum(buf))
 			++ReservedSectors;					// .hdi
 	}
@@ -39,8 +39,7 @@ protected:
 	}
 
 	void ReadSector(int sec, uint8_t buf[512]) {
-		Fs.Position = (ReservedSectors + sec) * BytesPerSector;
-		Fs.ReadExactly(buf, BytesPerSector);
+		ReadAt(CalcPosition(sec), buf, BytesPerSector);
 		Inverse(buf);
 	}
 
@@ -56,25 +55,28 @@ protected:
 	}
 
 	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override {
-		Fs.Position = CalcPosition(fileEntry.FirstCluster);
-		for (int64_t len = fileEntry.Length; len > 0; len -= 512) {
+		auto timer = Stats.Time(VolumeOp::CopyFileTo);
+		auto pos = CalcPosition(fileEntry.FirstCluster);
+		for (int64_t len = fileEntry.Length; len > 0; len -= 512, pos += 512) {
 			uint8_t buf[512];
-			Fs.ReadExactly(buf, 512);
+			if (ReadImage(pos, buf, 512) != 512)
+				Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
 			Inverse(buf);
 			os.WriteBuffer(buf, 512);
 		}
 	}
 
 	void ModifyFile(RCString filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) {
+		auto timer = Stats.Time(VolumeOp::ModifyFile);
 		EnsureWriteMode();
 		auto& e = *GetEntry(filename);
 		if (e.Length != len)
 			throw invalid_argument("Partition size is not equal to size of the new contents");
-		for (; len > 0; len -= 512) {
+		for (auto pos = CalcPosition(e.FirstCluster); len > 0; len -= 512, pos += 512) {
 			uint8_t buf[512];
 			istm.ReadExactly(buf, 512);
 			Inverse(buf);
-			Fs.WriteBuffer(buf, 512);
+			WriteAt(pos, buf);
 		}
 	}
 };
@@ -83,6 +85,7 @@ class AltProVolume : public HdiVolume {
 	typedef HdiVolume base;
 
 	void Init(const path& filepath) override {
+		auto timer = Stats.Time(VolumeOp::Init);
 		base::Init(filepath);
 		uint8_t buf[512];
 		ReadSector(7, buf);
@@ -90,11 +93,11 @@ class AltProVolume : public HdiVolume {
 		Heads = buf[508];
 		Sectors = load_little_u16(buf + 506);
 		Partitions = buf[504];
-		Files = GetDirEntries(0, false);
+		Files = ListDirectory(0);
 	}
 private:
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override {
-		vector<DirEntry> r;
+	bool EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
 		uint8_t buf[512];
 		ReadSector(7, buf);
 		for (int i = 0; i < Partitions; ++i) {
@@ -109,9 +112,10 @@ private:
 			e.FileName = "Partition " + Convert::ToString(i + 1) + ".dsk";
 			e.FirstCluster = (cyl * Heads + head) * Sectors;
 			e.Length = (uint32_t)load_little_u16(buf + 500 - i * 4) * BytesPerSector;
-			r.push_back(e);
+			if (!f(e))
+				return false;
 		}
-		return r;
+		return true;
 	}
 };
 
@@ -159,18 +163,19 @@ class SamaraVolume : public HdiVolume {
 	typedef HdiVolume base;
 
 	void Init(const path& filepath) override {
+		auto timer = Stats.Time(VolumeOp::Init);
 		base::Init(filepath);
 		uint8_t buf[512];
 		ReadSector(1, buf);
 		Heads = buf[5] + 1;
 		Sectors = buf[4];
 		int cylVol = load_little_u16(buf + 2);
-		Cylinders = int((Fs.Length / BytesPerSector - ReservedSectors + cylVol - 1) / cylVol);
-		Files = GetDirEntries(0, false);
+		Cylinders = int((ImageLength() / BytesPerSector - ReservedSectors + cylVol - 1) / cylVol);
+		Files = ListDirectory(0);
 	}
 
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override {
-		vector<DirEntry> r;
+	bool EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
 		uint8_t buf[512];
 		ReadSector(1, buf);
 		for (int i = 0; i < 64; ++i) {
@@ -184,9 +189,10 @@ class SamaraVolume : public HdiVolume {
 			e.ReadOnly = buf2[4] & 2;
 			e.FirstCluster = lba + 1;
 			e.Length = (uint32_t)load_little_u16(buf2 + 2) * BytesPerSector;
-			r.push_back(e);		
+			if (!f(e))
+				return false;
 		}
-		return r;
+		return true;
 	}
 };
 
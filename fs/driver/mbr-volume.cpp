@@ -11,7 +11,7 @@ namespace U::FS {
 
 class MbrVolume : public Volume {
 	void Init(const path& filePath) override { Throw(E_NOTIMPL); }
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override { Throw(E_NOTIMPL); }
+	bool EnumDirEntries(uint32_t dirId, bool bWithExtra, const CEnumCallback& f) override { Throw(E_NOTIMPL); }
 	CFiles::iterator GetEntry(RCString filename) override { Throw(E_NOTIMPL); }
 	void AddFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) override { Throw(E_NOTIMPL); }
 	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override { Throw(E_NOTIMPL); }
@@ -0,0 +1,233 @@
+// © 2023 Ufasoft https://ufasoft.com, Sergey Pavlov mailto:dev@ufasoft.com
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+// Cache file with parsed metadata of an image, named by the hash of the image path.
+// Layout: header, factory name, listings, driver data. Entries are fixed-size records followed by their names,
+// so the file is parsed in place from a mapped view.
+
+#include "pch.h"
+
+#include "volume.h"
+
+using namespace std;
+using namespace std::filesystem;
+
+extern "C" IMAGE_DOS_HEADER __ImageBase;
+
+namespace U::FS {
+
+namespace {
+
+const uint32_t c_metadataMagic = 0x4D4B5344						// "DSKM"
+	, c_metadataVersion = 2;										// Increment when a driver changes its SaveMetadata() format
+
+struct MetadataHeader {
+	uint32_t Magic, Version;
+	uint64_t ImageSize, LastWriteTime, KeyHash;
+	uint32_t ListingCount, CharSize;
+	uint64_t DriverDataSize;
+	uint32_t BuildId, Reserved;
+};
+
+struct EntryRecord {
+	int64_t Length, AllocationSize;
+	int64_t CreationTime, LastWriteTime, LastAccessTime, ExpirationTime, BackupTime;
+	uint64_t DirEntryDiskOffset, FirstCluster;
+	uint32_t Aux1, Aux2, Aux3;
+	int32_t EntrySize;
+	uint16_t Attrs, Flags;
+	uint32_t FileNameLength, AlternateFileNameLength, OriginalFilenameSize, ExtraDataSize;
+	uint32_t Reserved;												// Explicit tail padding, written as zero
+};
+
+enum : uint16_t {
+	FlagEmpty = 1
+	, FlagDirectory = 2
+	, FlagArchive = 4
+	, FlagSystem = 8
+	, FlagVolumeLabel = 16
+	, FlagHidden = 32
+	, FlagReadOnly = 64
+	, FlagAlternateFileName = 128
+};
+
+uint64_t HashBytes(const uint8_t* p, size_t size) {
+	uint64_t h = 0xCBF29CE484222325;								// FNV-1a
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ p[i]) * 0x100000001B3;
+	return h;
+}
+
+// Link timestamp of this module: parser changes of a new build invalidate the listings cached by an old one
+uint32_t ModuleBuildId() {
+	auto nt = (const IMAGE_NT_HEADERS*)((const uint8_t*)&__ImageBase + __ImageBase.e_lfanew);
+	return nt->FileHeader.TimeDateStamp;
+}
+
+// Per-user location, so that no files appear next to images in the user's folders
+path CachePath(const path& image) {
+	auto localAppData = Environment::GetEnvironmentVariable("LOCALAPPDATA");
+	auto dir = !!localAppData ? path(localAppData.c_wstr()) : temp_directory_path();
+	auto key = String(absolute(image).wstring().c_str()).ToUpper();
+	char name[32];
+	sprintf(name, "%016llx.dskmeta", (unsigned long long)HashBytes((const uint8_t*)key.c_wstr(), key.length() * sizeof(wchar_t)));
+	return dir / "Ufasoft" / "fs11-metadata" / name;
+}
+
+class SpanReader {
+public:
+	SpanReader(RCSpan s) : s_(s) {}
+
+	const uint8_t* Take(size_t size) {
+		if (size > s_.size() - off_)
+			Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+		auto r = s_.data() + off_;
+		off_ += size;
+		return r;
+	}
+
+	template <class T> T Read() {
+		T r;
+		memcpy(&r, Take(sizeof r), sizeof r);
+		return r;
+	}
+
+	size_t Remaining() const { return s_.size() - off_; }
+
+	String ReadString(uint32_t len) {
+		return String((const wchar_t*)Take(len * sizeof(wchar_t)), len);
+	}
+private:
+	Span s_;
+	size_t off_ = 0;
+};
+
+void WriteString(Stream& stm, RCString s) {
+	stm.WriteBuffer((const wchar_t*)s, s.length() * sizeof(wchar_t));
+}
+
+} // anonymous namespace
+
+MetadataCache::MetadataCache(const path& image)
+	: path_(CachePath(image))
+{
+	FileStream fs(image, FileMode::Open, FileAccess::Read, FileShare::ReadWrite);
+	imageSize_ = fs.Length;
+	lastWriteTime_ = (uint64_t)last_write_time(image).time_since_epoch().count();
+	uint8_t key[KeyBytes];
+	keyHash_ = HashBytes(key, fs.Read(key, sizeof key));
+}
+
+bool MetadataCache::Load() {
+	MappedImage mapping;
+	if (!exists(path_) || !mapping.Open(path_))
+		return false;
+	try {
+		SpanReader rd(mapping.View());
+		auto h = rd.Read<MetadataHeader>();
+		if (h.Magic != c_metadataMagic || h.Version != c_metadataVersion || h.BuildId != ModuleBuildId() || h.CharSize != sizeof(wchar_t)
+			|| h.ImageSize != imageSize_ || h.LastWriteTime != lastWriteTime_ || h.KeyHash != keyHash_)
+			return false;
+		FactoryName = rd.ReadString(rd.Read<uint32_t>());
+		Listings.clear();
+		for (uint32_t i = 0; i < h.ListingCount; ++i) {
+			auto dirId = rd.Read<uint32_t>();
+			bool bWithExtra = rd.Read<uint32_t>();
+			auto& entries = Listings[make_pair(dirId, bWithExtra)];
+			auto n = rd.Read<uint32_t>();
+			if (n > rd.Remaining() / sizeof(EntryRecord))
+				Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+			entries.resize(n);
+			for (auto& e : entries) {
+				auto r = rd.Read<EntryRecord>();
+				e.Length = r.Length;
+				e.AllocationSize = r.AllocationSize;
+				e.CreationTime = DateTime(r.CreationTime);
+				e.LastWriteTime = DateTime(r.LastWriteTime);
+				e.LastAccessTime = DateTime(r.LastAccessTime);
+				e.ExpirationTime = DateTime(r.ExpirationTime);
+				e.BackupTime = DateTime(r.BackupTime);
+				e.DirEntryDiskOffset = r.DirEntryDiskOffset;
+				e.FirstCluster = r.FirstCluster;
+				e.Aux1 = r.Aux1;
+				e.Aux2 = r.Aux2;
+				e.Aux3 = r.Aux3;
+				e.EntrySize = r.EntrySize;
+				e.Attrs = r.Attrs;
+				e.Empty = r.Flags & FlagEmpty;
+				e.IsDirectory = r.Flags & FlagDirectory;
+				e.IsArchive = r.Flags & FlagArchive;
+				e.IsSystem = r.Flags & FlagSystem;
+				e.IsVolumeLabel = r.Flags & FlagVolumeLabel;
+				e.Hidden = r.Flags & FlagHidden;
+				e.ReadOnly = r.Flags & FlagReadOnly;
+				e.FileName = rd.ReadString(r.FileNameLength);
+				if (r.Flags & FlagAlternateFileName)
+					e.AlternateFileName = rd.ReadString(r.AlternateFileNameLength);
+				if (r.OriginalFilenameSize)
+					e.OriginalFilenamePresentation = Blob(rd.Take(r.OriginalFilenameSize), r.OriginalFilenameSize);
+				if (r.ExtraDataSize)
+					e.ExtraData = Blob(rd.Take(r.ExtraDataSize), r.ExtraDataSize);
+			}
+		}
+		auto p = rd.Take((size_t)h.DriverDataSize);
+		DriverData.assign(p, p + h.DriverDataSize);
+		return true;
+	} catch (exception&) {
+		TRC(1, "Ignoring corrupted " << path_);
+		Listings.clear();
+		return false;
+	}
+}
+
+void MetadataCache::Save() const {
+	try {
+		error_code ec;
+		create_directories(path_.parent_path(), ec);
+		FileStream stm(path_, FileMode::Create, FileAccess::Write);
+		MetadataHeader h = { c_metadataMagic, c_metadataVersion, imageSize_, lastWriteTime_, keyHash_, (uint32_t)Listings.size(), sizeof(wchar_t), DriverData.size(), ModuleBuildId() };
+		stm.WriteBuffer(&h, sizeof h);
+		uint32_t len = (uint32_t)FactoryName.length();
+		stm.WriteBuffer(&len, sizeof len);
+		WriteString(stm, FactoryName);
+		for (auto& kv : Listings) {
+			uint32_t listing[3] = { kv.first.first, kv.first.second, (uint32_t)kv.second.size() };
+			stm.WriteBuffer(listing, sizeof listing);
+			for (auto& e : kv.second) {
+				bool hasAlternate = !!e.AlternateFileName;
+				Span original = e.OriginalFilenamePresentation
+					, extra = e.ExtraData;
+				EntryRecord r = {
+					e.Length, e.AllocationSize
+					, e.CreationTime.Ticks, e.LastWriteTime.Ticks, e.LastAccessTime.Ticks, e.ExpirationTime.Ticks, e.BackupTime.Ticks
+					, e.DirEntryDiskOffset, e.FirstCluster
+					, e.Aux1, e.Aux2, e.Aux3
+					, e.EntrySize
+					, e.Attrs
+					, uint16_t((e.Empty ? FlagEmpty : 0)
+						| (e.IsDirectory ? FlagDirectory : 0)
+						| (e.IsArchive ? FlagArchive : 0)
+						| (e.IsSystem ? FlagSystem : 0)
+						| (e.IsVolumeLabel ? FlagVolumeLabel : 0)
+						| (e.Hidden ? FlagHidden : 0)
+						| (e.ReadOnly ? FlagReadOnly : 0)
+						| (hasAlternate ? FlagAlternateFileName : 0))
+					, (uint32_t)e.FileName.length(), hasAlternate ? (uint32_t)e.AlternateFileName.length() : 0
+					, (uint32_t)original.size(), (uint32_t)extra.size()
+					, 0
+				};
+				stm.WriteBuffer(&r, sizeof r);
+				WriteString(stm, e.FileName);
+				if (hasAlternate)
+					WriteString(stm, e.AlternateFileName);
+				stm.WriteBuffer(original.data(), original.size());
+				stm.WriteBuffer(extra.data(), extra.size());
+			}
+		}
+		stm.WriteBuffer(DriverData.data(), DriverData.size());
+	} catch (exception&) {											// Read-only location
+		TRC(1, "Cannot save " << path_);
+	}
+}
+
+} // U::FS
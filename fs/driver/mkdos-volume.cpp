@@ -32,36 +32,35 @@ public:
 		, DirectorySector;
 
 	void Init(const path& filepath) override {
+		auto timer = Stats.Time(VolumeOp::Init);
 		base::Init(filepath);
 
 		array<uint8_t, 512> buf;
 		auto data = buf.data();
-		Fs.ReadExactly(buf.data(), buf.size());
+		ReadAt(0, buf.data(), buf.size());
 
 		CurDirEntries = load_little_u16(data + 030);
 		TotalUsedSectors = load_little_u16(data + 032);
 		TotalSectors = load_little_u16(data + 0466);
 		FirstDataCluster = load_little_u16(data + 0470);
 
-		Files = GetDirEntries(0, false);
+		Files = ListDirectory(0);
 	}
 
 	int MaxNameLength() override { return 14; }
 
 	void RemoveFile(RCString filename) {
+		auto timer = Stats.Time(VolumeOp::RemoveFile);
 		EnsureWriteMode();
 		auto it = GetEntry(filename);
-		Fs.Position = it->DirEntryDiskOffset + 1;
 		uint8_t statusDeleted = (uint8_t)EntryStatus::Deleted;
-		Fs.WriteBuffer(&statusDeleted, 1);
+		WriteAt(it->DirEntryDiskOffset + 1, Span(&statusDeleted, 1));
 		Files.erase(it);
 	}
 protected:
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override {
-		Fs.Position = 0500;
-		vector<uint8_t> rootDir(MaxDirEntries * EntrySize);
-		Fs.ReadExactly(rootDir.data(), rootDir.size());
-		vector<DirEntry> r;
+	bool EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) override {
+		auto timer = Stats.Time(VolumeOp::GetDirEntries);
+		auto rootDir = ReadView(0500, MaxDirEntries * EntrySize);
 		auto p = rootDir.data();
 		uint8_t dirId = 0;
 		for (int i = 0, j = 0; j < CurDirEntries && i < MaxDirEntries; ++i, p += EntrySize) {
@@ -80,7 +79,7 @@ protected:
 				++j;
 				e.Aux2 = p[1];
 				e.ReadOnly = status == EntryStatus::ReadOnly;
-				if (e.Aux2 == CurDirId || bWithExtra) {
+				if (e.Aux2 == cluster || bWithExtra) {
 					Span spanName = Span(p + 2, 14);
 					for (int off = 13; off-- > 2;)
 						if (!spanName[off])
@@ -93,12 +92,13 @@ protected:
 					auto rem = load_little_u16(p + 22);
 					e.AllocationSize = nBlocks * BytesPerSector;
 					e.Length = rem ? ((e.AllocationSize - 1) & 0xFFFFE000) | rem : e.AllocationSize;
-					r.push_back(e);
+					if (!f(e))
+						return false;
 				}
 				break;
 			}
 		}
-		return r;
+		return true;
 	}
 
 	void Serialize(Stream& stm, const DirEntry& e) override {
@@ -123,8 +123,7 @@ protected:
 	}
 
 	void SaveDirStreamToVolume(Stream& stm) override {
-		Fs.Position = 0500;
-		stm.CopyTo(Fs);
+		WriteAt(0500, stm);
 	}
 
 	void SaveDirEntries(const CFiles& entries) override {
@@ -138,7 +137,7 @@ protected:
 		uint8_t bufMetaData[4];
 		store_little_u16(bufMetaData, (uint16_t)entries.size());
 		store_little_u16(bufMetaData + 2, usedSectors);
-		Fs.Write(030, bufMetaData);
+		WriteAt(030, bufMetaData);
 	}
 
 	int64_t FreeSpace() {
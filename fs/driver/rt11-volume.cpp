@@ -90,16 +90,13 @@ DateTime Rt11Volume::FromRt11DateFormat(uint16_t date) {
 		: s_defaultDate;
 }
 
-vector<DirEntry> Rt11Volume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
-	vector<DirEntry> r;
-	uint8_t homeBlock[512];
-	ReadBlock(1, homeBlock);
-	uint8_t segmentSectors[1024];
-	auto blkSegment = load_little_u16(homeBlock + 0724);
+bool Rt11Volume::EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) {
+	auto timer = Stats.Time(VolumeOp::GetDirEntries);
+	auto blkSegment = load_little_u16(ReadView(512, 512).data() + 0724);		// Home block
 	for (uint16_t nextSegment = 1; nextSegment;) {
 		auto blk = blkSegment + (nextSegment - 1) * 2;
-		ReadBlock(blk, segmentSectors);
-		ReadBlock(blk + 1, segmentSectors + 512);
+		auto segment = ReadView((uint64_t)blk * 512, 1024);
+		const uint8_t* segmentSectors = segment.data();
 		nextSegment = load_little_u16(segmentSectors + 2);
 		auto extraBytes = load_little_u16(segmentSectors + 6);
 		auto fileDataBlock = load_little_u16(segmentSectors + 8);
@@ -118,8 +115,7 @@ vector<DirEntry> Rt11Volume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
 				dirEntry.Empty = true;
 				break;
 			default:
-				dirEntry.FileName = (DecodeRadix50(load_little_u16(entry + 2)) + DecodeRadix50(load_little_u16(entry + 4))).Trim()
-					+ "." + DecodeRadix50(load_little_u16(entry + 6)).Trim();
+				dirEntry.FileName = GetRadix50Filename(entry + 2, 2);
 				try {
 					dirEntry.CreationTime = FromRt11DateFormat(load_little_u16(entry + 12));
 				} catch (const exception&) {
@@ -137,13 +133,13 @@ vector<DirEntry> Rt11Volume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
 			dirEntry.Length = len * 512;
 			dirEntry.Aux1 = load_little_u16(entry + 10);		// #channel, #job
 			dirEntry.ExtraData = Blob(entry + 14, extraBytes);
-			if (!dirEntry.Empty || bWithExtra)
-				r.push_back(dirEntry);
+			if ((!dirEntry.Empty || bWithExtra) && !f(dirEntry))
+				return false;
 		}
 	LAB_EOS:
 		;
 	}
-	return r;
+	return true;
 }
 
 class DirectoryWriter {
@@ -179,8 +175,7 @@ class DirectoryWriter {
 		if (bLast) {
 			uint8_t highestSegmentInUse[2];
 			store_little_u16(highestSegmentInUse, curSegmentId);
-			volume.Fs.Position = secDirectory * 512 + 4;
-			volume.Fs.WriteBuffer(highestSegmentInUse, sizeof(highestSegmentInUse));
+			volume.WriteAt(secDirectory * 512 + 4, highestSegmentInUse);
 		}
 
 		curSegmentId = curSegmentId + 1;
@@ -273,9 +268,11 @@ void Rt11Volume::WriteDirectory() {
 
 int64_t Rt11Volume::FreeSpace() {
 	int64_t freeSpace = 0;
-	for (const auto& e : GetDirEntries(true))
+	EnumDirEntries(0, true, [&freeSpace](const DirEntry& e) {
 		if (e.Empty)
 			freeSpace += e.Length;
+		return true;
+	});
 	return freeSpace;
 }
 
@@ -289,35 +286,29 @@ void Rt11Volume::InsertIntoFiles(const DirEntry& entry) {
 	Files.push_back(entry);
 }
 
-void Rt11Volume::CopyFileTo(const DirEntry& fileEntry, Stream& os) {
-	for (int i = 0, nBlocks = int((fileEntry.Length + 511) / 512); i < nBlocks; ++i) {
-		byte block[512];
-		ReadBlock(uint32_t(fileEntry.FirstCluster + i), block);
-		os.WriteBuffer(block, 512);
-	}
-}
-
-Rt11Volume::CFiles::iterator Rt11Volume::GetEntry(RCString filename) {
-	for (auto it = Files.begin(); it != Files.end(); ++it)
-		if (it->FileName == filename)
-			return it;
-	Throw(errc::no_such_file_or_directory);
+vector<Extent> Rt11Volume::GetFileExtents(const DirEntry& entry) {
+	return vector<Extent>{ Extent{ entry.FirstCluster, uint64_t(entry.Length + 511) / 512 } };
 }
 
 void Rt11Volume::RemoveFile(RCString filename) {
+	auto timer = Stats.Time(VolumeOp::RemoveFile);
 	EnsureWriteMode();
 	auto it = GetEntry(filename);
-	Fs.Position = it->DirEntryDiskOffset;
 	uint16_t status = (uint16_t)DirectoryEntryStatus::Empty;
-	char buf[2] = { (char)status, (char)(status >> 8) };
-	Fs.WriteBuffer(buf, 2);
+	uint8_t buf[2] = { (uint8_t)status, (uint8_t)(status >> 8) };
+	WriteAt(it->DirEntryDiskOffset, buf);
 	Files.erase(it);
 }
 
 // Squeeze
 void Rt11Volume::Defragment() {
+	auto timer = Stats.Time(VolumeOp::Defragment);
 	EnsureWriteMode();
-	uint16_t curFreeDataSector = (uint16_t)GetDirEntries(true)[0].FirstCluster;
+	uint16_t curFreeDataSector = 0;
+	EnumDirEntries(0, true, [&curFreeDataSector](const DirEntry& e) {
+		curFreeDataSector = (uint16_t)e.FirstCluster;
+		return false;
+	});
 	for (auto& entry : Files) {
 		uint16_t nSizeInBlocks = uint16_t(entry.Length / 512);
 		if (entry.FirstCluster > curFreeDataSector) {
@@ -339,23 +330,17 @@ pair<vector<wchar_t>, vector<wchar_t>> Rt11Volume::ValidInvalidFilenameChars() {
 }
 
 void Rt11Volume::AddFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) {
-	auto uppercaseFilename = filename.ToUpper();
-	for (auto& e : Files) {
-		if (e.FileName == uppercaseFilename)
-			Throw(errc::file_exists);
-	}
+	if (FindEntry(filename.ToUpper()) != Files.end())
+		Throw(errc::file_exists);
 	ModifyFile(filename, len, istm, creationTimestamp);
 }
 
 void Rt11Volume::ModifyFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) {
+	auto timer = Stats.Time(VolumeOp::ModifyFile);
 	EnsureWriteMode();
 	auto uppercaseFilename = filename.ToUpper();
-	for (auto& e : Files) {
-		if (e.FileName == uppercaseFilename) {
-			RemoveFile(filename);
-			break;
-		}
-	}
+	if (FindEntry(uppercaseFilename) != Files.end())
+		RemoveFile(uppercaseFilename);
 
 	auto nSector = uint16_t((len + 511) / 512);
 	auto o = Allocate(nSector);
@@ -371,12 +356,10 @@ void Rt11Volume::ModifyFile(const String& filename, uint64_t len, Stream& istm,
 	entry.Empty = false;
 	entry.CreationTime = creationTimestamp;
 	if (nSector) {
-		byte buf[512];
+		uint8_t buf[512];
 		ZeroStruct(buf);
-		Fs.Position = (entry.FirstCluster + nSector - 1) * BytesPerSector;
-		Fs.WriteBuffer(buf, 512);			// Zero last block to avoid garbage if istm size is not multiple of 512
-		Fs.Position = (uint64_t)entry.FirstCluster * BytesPerSector;
-		istm.CopyTo(Fs);
+		WriteAt((entry.FirstCluster + nSector - 1) * BytesPerSector, buf);			// Zero last block to avoid garbage if istm size is not multiple of 512
+		WriteAt((uint64_t)entry.FirstCluster * BytesPerSector, istm);
 	}
 	Files = GetFiles();
 	InsertIntoFiles(entry);
@@ -384,12 +367,23 @@ void Rt11Volume::ModifyFile(const String& filename, uint64_t len, Stream& istm,
 }
 
 void Rt11Volume::Init(const path& filepath) {
+	auto timer = Stats.Time(VolumeOp::Init);
 	base::Init(filepath);
+	RestoreMetadata();					// NumberOfBlocks, otherwise computed while listing the directory
 	Files = GetFiles();
 }
 
+void Rt11Volume::SaveMetadata(Stream& stm) {
+	stm.WriteBuffer(&NumberOfBlocks, sizeof NumberOfBlocks);
+}
+
+void Rt11Volume::LoadMetadata(const Stream& stm) {
+	stm.ReadExactly(&NumberOfBlocks, sizeof NumberOfBlocks);
+}
+
 Rt11Volume::Rt11Volume()
 {
+	CaseSensitive = true;				// Radix-50 names are upper case
 }
 
 Rt11Volume::~Rt11Volume() {
@@ -397,22 +391,22 @@ Rt11Volume::~Rt11Volume() {
 }
 
 void Rt11Volume::ReadBlock(int n, void* data) {
-	Fs.Position = n * 512;
-	Fs.ReadExactly(data, 512);
+	ReadAt((uint64_t)n * 512, data, 512);
 }
 
 void Rt11Volume::WriteBlock(int n, const void* data) {
 	EnsureWriteMode();
-	Fs.Position = n * 512;
-	Fs.WriteBuffer(data, 512);
+	WriteAt((uint64_t)n * 512, Span((const uint8_t*)data, 512));
 }
 
 optional<DirEntry> Rt11Volume::Allocate(uint16_t nBlock) {
-	for (auto& entry : GetDirEntries(true)) {
+	optional<DirEntry> r;
+	EnumDirEntries(0, true, [&r, nBlock](const DirEntry& entry) {
 		if (entry.Empty && entry.Length >= nBlock * 512)
-			return entry;
-	}
-	return optional<DirEntry>();
+			r = entry;
+		return !r;
+	});
+	return r;
 }
 
 void DirEntry::Read(const BinaryReader& rd) {
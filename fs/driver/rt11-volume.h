@@ -26,14 +26,13 @@ public:
 	uint16_t NumberOfBlocks = 0;
 
 	static DateTime FromRt11DateFormat(uint16_t v);
-	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) override;
+	bool EnumDirEntries(uint32_t cluster, bool bWithExtra, const CEnumCallback& f) override;
 	void WriteDirectory();
 	void InsertIntoFiles(const DirEntry& entry);
 	int64_t FreeSpace() override;
-	CFiles::iterator GetEntry(RCString filename) override;
 	void AddFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) override;
 	void ModifyFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) override;
-	void CopyFileTo(const DirEntry& fileEntry, Stream& os) override;
+	vector<Extent> GetFileExtents(const DirEntry& entry) override;
 	void RemoveFile(RCString filename) override;
 	void Defragment() override;
 	void MakeDirectory(RCString name) override { Throw(errc::not_supported); }
@@ -41,6 +40,8 @@ public:
 	int MaxNameLength() override { return 10; }
 
 	void Init(const path& filepath) override;
+	void SaveMetadata(Stream& stm) override;
+	void LoadMetadata(const Stream& stm) override;
 	Rt11Volume();
 	~Rt11Volume();
 private:
@@ -62,10 +63,6 @@ private:
 
 	optional<DirEntry> Allocate(uint16_t nBlock);
 
-	vector<DirEntry> GetDirEntries(bool bWithExtra) {
-		return GetDirEntries(0, bWithExtra);
-	}
-
 	friend class DirectoryWriter;
 };
 
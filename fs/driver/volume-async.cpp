@@ -0,0 +1,146 @@
+// © 2023 Ufasoft https://ufasoft.com, Sergey Pavlov mailto:dev@ufasoft.com
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+// Batched extraction of many files. Extent reads of all files are queued on an overlapped handle
+// and completed in submission order into the per-file output streams.
+
+#include "pch.h"
+
+#include "volume.h"
+
+using namespace std;
+using namespace std::filesystem;
+
+namespace U::FS {
+
+namespace {
+
+struct ReadRequest {
+	size_t Job;
+	uint64_t Offset;
+	uint32_t Size;
+};
+
+class OverlappedReader {
+public:
+	OverlappedReader(const path& p, int queueDepth)
+		: depth_(max(queueDepth, 1))
+		, slots_(new Slot[depth_]) {
+		for (int i = 0; i < depth_; ++i)						// Events are owned by slots_, which is destroyed if this throws
+			if (!(slots_[i].Ov.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr)))
+				Throw(HRESULT_FROM_WIN32(::GetLastError()));
+		handle_ = ::CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);	// Last: nothing may throw after it
+	}
+
+	~OverlappedReader() {
+		if (handle_ == INVALID_HANDLE_VALUE)
+			return;
+		::CancelIo(handle_);
+		for (int i = 0; i < depth_; ++i) {				// Kernel must not write into freed buffers
+			DWORD cb;
+			if (slots_[i].Pending)
+				::GetOverlappedResult(handle_, &slots_[i].Ov, &cb, TRUE);
+		}
+		::CloseHandle(handle_);
+	}
+
+	bool IsOpen() const { return handle_ != INVALID_HANDLE_VALUE; }
+
+	void Run(const vector<ReadRequest>& reqs, const vector<CopyJob>& jobs) {
+		size_t next = 0;
+		for (int i = 0; i < depth_ && next < reqs.size(); ++i)
+			Submit(slots_[i], reqs[next++]);
+
+		// Slot i holds requests i, i + depth, ..., so visiting slots cyclically consumes completions in submission order
+		for (size_t done = 0, i = 0; done < reqs.size(); ++done, i = (i + 1) % depth_) {
+			auto& slot = slots_[i];
+			DWORD cb;
+			BOOL ok = ::GetOverlappedResult(handle_, &slot.Ov, &cb, TRUE);
+			slot.Pending = false;
+			if (!ok)
+				Throw(HRESULT_FROM_WIN32(::GetLastError()));
+			if (cb != slot.Req->Size)
+				Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+			jobs[slot.Req->Job].Os->WriteBuffer(slot.Buf.data(), cb);
+			if (next < reqs.size())
+				Submit(slot, reqs[next++]);
+		}
+	}
+private:
+	struct Slot {
+		OVERLAPPED Ov;
+		vector<uint8_t> Buf;
+		const ReadRequest* Req = nullptr;
+		bool Pending = false;
+
+		Slot() {
+			ZeroStruct(Ov);
+		}
+
+		~Slot() {
+			if (Ov.hEvent)
+				::CloseHandle(Ov.hEvent);
+		}
+	};
+
+	HANDLE handle_ = INVALID_HANDLE_VALUE;
+	int depth_;
+	unique_ptr<Slot[]> slots_;
+
+	void Submit(Slot& slot, const ReadRequest& req) {
+		slot.Req = &req;
+		slot.Buf.resize(req.Size);
+		slot.Ov.Offset = (DWORD)req.Offset;
+		slot.Ov.OffsetHigh = DWORD(req.Offset >> 32);
+		if (!::ReadFile(handle_, slot.Buf.data(), req.Size, nullptr, &slot.Ov)) {
+			auto dw = ::GetLastError();
+			if (dw != ERROR_IO_PENDING)
+				Throw(HRESULT_FROM_WIN32(dw));
+		}
+		slot.Pending = true;
+	}
+};
+
+} // namespace
+
+void Volume::CopyFilesTo(const vector<CopyJob>& jobs, int queueDepth) {
+	const uint32_t maxRequestSize = 256 * 1024;
+
+	if (!Mapping.IsOpen() && !Compressed && Overlay.empty()) {				// Mapped images are already copied without syscalls per extent
+		OverlappedReader reader(filepath_, queueDepth);
+		if (reader.IsOpen()) {
+			vector<ReadRequest> reqs;
+			for (size_t i = 0; i < jobs.size(); ++i) {
+				auto& job = jobs[i];
+				vector<Extent> extents;
+				try {
+					extents = GetFileExtents(*job.Entry);
+				} catch (Exception& ex) {
+					if (ex.code() != error_code(E_NOTIMPL, hresult_category()))
+						throw;
+					CopyFileTo(*job.Entry, *job.Os);				// Driver transforms contents
+					continue;
+				}
+				WriteFilePrefix(*job.Entry, *job.Os);
+				uint64_t len = job.Entry->Length;
+				for (auto& run : MergeExtents(extents)) {
+					for (uint64_t off = run.Lba * BytesPerSector, end = off + min(len, run.Count * BytesPerSector); off < end;) {
+						auto cb = (uint32_t)min(end - off, (uint64_t)maxRequestSize);
+						reqs.push_back(ReadRequest{ i, off, cb });
+						Stats.OnRead(off, cb);
+						off += cb;
+						len -= cb;
+					}
+				}
+				if (len)
+					Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+			}
+			reader.Run(reqs, jobs);
+			return;
+		}
+	}
+	for (auto& job : jobs)
+		CopyFileTo(*job.Entry, *job.Os);
+}
+
+} // U::FS
@@ -15,10 +15,227 @@ const CodePageEncoding s_encodingKoi8(20866);
 
 static const CodePageEncoding s_encodingOem(CP_OEMCP);
 
+void SectorCache::SetBudget(size_t bytes) {
+	budget_ = bytes;
+	Trim();
+}
+
+void SectorCache::Trim() {
+	for (auto n = budget_ / SectorSize; lru_.size() > n;) {
+		map_.erase(lru_.back().first);
+		lru_.pop_back();
+	}
+}
+
+VolumeStats::Timer::Timer(VolumeStats& stats, VolumeOp op)
+	: stats_(stats)
+	, op_(op)
+	, start_(chrono::steady_clock::now()) {
+	++stats_.depth_[(int)op_];
+}
+
+VolumeStats::Timer::~Timer() {
+	if (--stats_.depth_[(int)op_])
+		return;
+	auto us = (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_).count();
+	auto& op = stats_.ops_[(int)op_];
+	++op.Calls;
+	op.TotalMicroseconds += us;
+	op.MaxMicroseconds = max(op.MaxMicroseconds, us);
+	int bucket = 0;
+	for (auto v = us; v && bucket < Buckets - 1; v >>= 1)
+		++bucket;
+	++op.Histogram[bucket];
+}
+
+void VolumeStats::OnAccess(uint64_t offset, uint64_t size) {
+	if (offset != nextOffset_)
+		++Seeks;
+	nextOffset_ = offset + size;
+}
+
+void VolumeStats::OnRead(uint64_t offset, uint64_t size) {
+	++ReadCalls;
+	BytesRead += size;
+	OnAccess(offset, size);
+}
+
+void VolumeStats::OnWrite(uint64_t offset, uint64_t size) {
+	++WriteCalls;
+	BytesWritten += size;
+	OnAccess(offset, size);
+}
+
+void VolumeStats::Reset() {
+	ReadCalls = WriteCalls = BytesRead = BytesWritten = Seeks = 0;
+	for (auto& op : ops_)
+		op = OpStats();
+	nextOffset_ = 0;
+}
+
+const char* VolumeStats::OpName(VolumeOp op) {
+	static const char* const s_names[(int)VolumeOp::Count] = { "Init", "GetDirEntries", "CopyFileTo", "ModifyFile", "RemoveFile", "Defragment" };
+	return s_names[(int)op];
+}
+
+String Volume::StatsToJson() const {
+	ostringstream os;
+	os << "{\"reads\":" << Stats.ReadCalls
+		<< ",\"writes\":" << Stats.WriteCalls
+		<< ",\"bytesRead\":" << Stats.BytesRead
+		<< ",\"bytesWritten\":" << Stats.BytesWritten
+		<< ",\"seeks\":" << Stats.Seeks
+		<< ",\"cache\":{\"hits\":" << Cache.Hits << ",\"misses\":" << Cache.Misses << "}"
+		<< ",\"ops\":{";
+	for (int i = 0; i < (int)VolumeOp::Count; ++i) {
+		auto& op = Stats[(VolumeOp)i];
+		os << (i ? "," : "") << "\"" << VolumeStats::OpName((VolumeOp)i) << "\":{\"calls\":" << op.Calls
+			<< ",\"totalUs\":" << op.TotalMicroseconds
+			<< ",\"maxUs\":" << op.MaxMicroseconds
+			<< ",\"histogramLog2Us\":[";
+		int last = VolumeStats::Buckets;							// Trailing empty buckets are omitted
+		while (last && !op.Histogram[last - 1])
+			--last;
+		for (int j = 0; j < last; ++j)
+			os << (j ? "," : "") << op.Histogram[j];
+		os << "]}";
+	}
+	os << "}}";
+	return os.str();
+}
+
+SectorOverlay::CSector* SectorOverlay::Find(uint64_t sector) {
+	auto it = sectors_.find(sector);
+	return it == sectors_.end() ? nullptr : &it->second;
+}
+
+bool SectorOverlay::Overlaps(uint64_t offset, size_t size) const {
+	auto it = sectors_.lower_bound(offset / SectorCache::SectorSize);
+	return size && it != sectors_.end() && it->first * SectorCache::SectorSize < offset + size;
+}
+
+void SectorOverlay::Update(uint64_t offset, RCSpan s) {
+	const uint64_t secSize = SectorCache::SectorSize;
+	auto end = offset + s.size();
+	for (auto it = sectors_.lower_bound(offset / secSize); it != sectors_.end() && it->first * secSize < end; ++it) {
+		auto from = max(offset, it->first * secSize)
+			, to = min(end, (it->first + 1) * secSize);
+		memcpy(it->second.data() + (from - it->first * secSize), s.data() + (from - offset), size_t(to - from));
+	}
+}
+
+void SectorOverlay::Apply(uint64_t offset, uint8_t* buf, size_t size) const {
+	const uint64_t secSize = SectorCache::SectorSize;
+	auto end = offset + size;
+	for (auto it = sectors_.lower_bound(offset / secSize); it != sectors_.end() && it->first * secSize < end; ++it) {
+		auto from = max(offset, it->first * secSize)
+			, to = min(end, (it->first + 1) * secSize);
+		memcpy(buf + (from - offset), it->second.data() + (from - it->first * secSize), size_t(to - from));
+	}
+}
+
+void SectorOverlay::ForEachRun(size_t maxRun, const function<void(uint64_t, RCSpan)>& f) const {
+	const uint64_t secSize = SectorCache::SectorSize;
+	vector<uint8_t> buf;
+	uint64_t first = 0;
+	for (auto it = sectors_.begin(); it != sectors_.end(); ++it) {
+		if (!buf.empty() && (first + buf.size() / secSize != it->first || buf.size() + secSize > maxRun)) {
+			f(first * secSize, Span(buf.data(), buf.size()));
+			buf.clear();
+		}
+		if (buf.empty())
+			first = it->first;
+		buf.insert(buf.end(), it->second.begin(), it->second.end());
+	}
+	if (!buf.empty())
+		f(first * secSize, Span(buf.data(), buf.size()));
+}
+
+void SectorOverlay::Clear() {
+	sectors_.clear();
+	End = 0;
+}
+
+const uint8_t* SectorCache::Find(uint64_t sector) {
+	auto it = map_.find(sector);
+	if (it == map_.end())
+		return nullptr;
+	lru_.splice(lru_.begin(), lru_, it->second);
+	return it->second->second.data();
+}
+
+void SectorCache::Put(uint64_t sector, const uint8_t data[SectorSize]) {
+	if (budget_ < SectorSize)
+		return;
+	auto it = map_.find(sector);
+	if (it != map_.end())
+		lru_.splice(lru_.begin(), lru_, it->second);
+	else {
+		lru_.emplace_front(sector, CSector());
+		map_[sector] = lru_.begin();
+	}
+	memcpy(lru_.front().second.data(), data, SectorSize);
+	Trim();
+}
+
+void SectorCache::Update(uint64_t offset, RCSpan s) {
+	if (map_.empty() || s.empty())
+		return;
+	auto end = offset + s.size();
+	for (auto sec = offset / SectorSize; sec * SectorSize < end; ++sec) {
+		auto it = map_.find(sec);
+		if (it == map_.end())
+			continue;
+		auto from = max(offset, sec * SectorSize)
+			, to = min(end, (sec + 1) * SectorSize);
+		memcpy(it->second->second.data() + (from - sec * SectorSize), s.data() + (from - offset), size_t(to - from));
+	}
+}
+
+void SectorCache::Invalidate() {
+	map_.clear();
+	lru_.clear();
+}
+
+bool MappedImage::Open(const path& p) {
+	Close();
+	hFile_ = ::CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	if (hFile_ == INVALID_HANDLE_VALUE
+		|| !::GetFileSizeEx(hFile_, &size)
+		|| size.QuadPart == 0 || (uint64_t)size.QuadPart > MaxSize
+		|| !(hMapping_ = ::CreateFileMappingW(hFile_, nullptr, PAGE_READONLY, 0, 0, nullptr))
+		|| !(data_ = (const uint8_t*)::MapViewOfFile(hMapping_, FILE_MAP_READ, 0, 0, 0))) {
+		TRC(1, "Cannot map " << p << ", falling back to stream I/O");
+		Close();
+		return false;
+	}
+	size_ = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedImage::Close() {
+	if (data_)
+		::UnmapViewOfFile(exchange(data_, nullptr));
+	if (hMapping_)
+		::CloseHandle(exchange(hMapping_, nullptr));
+	if (hFile_ != INVALID_HANDLE_VALUE)
+		::CloseHandle(exchange(hFile_, INVALID_HANDLE_VALUE));
+	size_ = 0;
+}
+
 Volume::Volume() : Encoding(&s_encodingOem) {
 }
 
 Volume::~Volume() {
+	if (!overlay_ && !Overlay.empty()) {
+		try {
+			WriteBack();
+		} catch (exception&) {
+			TRC(1, "Write-back failed " << filepath_);
+		}
+	}
+	TRC(1, "Closing " << filepath_ << " I/O: " << StatsToJson());
 }
 
 pair<vector<wchar_t>, vector<wchar_t>> Volume::ValidInvalidFilenameChars() {
@@ -30,31 +247,299 @@ pair<vector<wchar_t>, vector<wchar_t>> Volume::ValidInvalidFilenameChars() {
 }
 
 void Volume::Init(const path& filepath) {
+	auto timer = Stats.Time(VolumeOp::Init);
 	TRC(1, "Opening file " << filepath << "  this: " << this);
 
 	filepath_ = filepath;
-	Fs.Open(filepath_, FileMode::Open, FileAccess::Read, FileShare::Read);
+	if (!(Compressed = CompressedImage::Open(filepath_))) {
+		Fs.Open(filepath_, FileMode::Open, FileAccess::Read, FileShare::Read);
+		Mapping.Open(filepath_);
+	}
 	Filename = filepath_.filename().native();
+	if (metadata_) {
+		listings_ = metadata_->Listings;
+		listingsGeneration_ = generation_;
+	}
+}
+
+bool Volume::RestoreMetadata() {
+	if (!metadata_)
+		return false;
+	try {
+		CMemReadStream stm(Span(metadata_->DriverData.data(), metadata_->DriverData.size()));
+		LoadMetadata(stm);
+		return true;
+	} catch (exception&) {
+		TRC(1, "Cached metadata of " << filepath_ << " is inconsistent");
+		listings_.clear();
+		return false;
+	}
+}
+
+void Volume::CacheMetadata(MetadataCache& cache) {
+	if (_openedForModifying || generation_ || listingsGeneration_ != generation_)
+		return;
+	cache.Listings = listings_;
+	MemoryStream ms;
+	SaveMetadata(ms);
+	Span s = ms.AsSpan();
+	cache.DriverData.assign(s.data(), s.data() + s.size());
+	cache.Save();
+}
+
+static Span TrimSpan(Span s) {
+	auto isSpace = [](uint8_t c) { return c == ' ' || c >= '\t' && c <= '\r'; };
+	while (!s.empty() && isSpace(s.front()))
+		s = s.subspan(1);
+	while (!s.empty() && isSpace(s.back()))
+		s = s.subspan(0, s.size() - 1);
+	return s;
+}
+
+void NameTable::clear() {
+	map_.clear();
+	chunks_.clear();
+	chunkUsed_ = ChunkSize;
+}
+
+string_view NameTable::Store(string_view key) {
+	if (key.size() > ChunkSize - chunkUsed_) {
+		chunks_.push_back(make_unique<char[]>((max)(ChunkSize, key.size())));
+		chunkUsed_ = 0;
+	}
+	char* p = chunks_.back().get() + chunkUsed_;
+	memcpy(p, key.data(), key.size());
+	chunkUsed_ += key.size();
+	return string_view(p, key.size());
 }
 
 String Volume::GetFilenamePart(const Span& s) {
-	return Encoding->GetString(s).Trim();
+	return Names.Intern(NameKind::Text, TrimSpan(s), [this](RCSpan raw) { return Encoding->GetString(raw); });
+}
+
+String Volume::GetFilename(const Span& name, const Span& ext) {
+	Span n = TrimSpan(name), x = TrimSpan(ext);
+	uint8_t buf[256];
+	if (n.size() + x.size() + 1 > size(buf))
+		Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+	memcpy(buf, n.data(), n.size());
+	size_t len = n.size();
+	if (!x.empty()) {
+		buf[len++] = '.';
+		memcpy(buf + len, x.data(), x.size());
+		len += x.size();
+	}
+	return Names.Intern(NameKind::Text, Span(buf, len), [this](RCSpan raw) { return Encoding->GetString(raw); });
+}
+
+String Volume::GetRadix50Filename(const uint8_t* p, int nNameWords) {
+	return Names.Intern(NameKind::Radix50, Span(p, (nNameWords + 1) * 2), [nNameWords](RCSpan raw) {
+		String name;
+		for (int i = 0; i < nNameWords; ++i)
+			name += DecodeRadix50(load_little_u16(raw.data() + i * 2));
+		return name.Trim() + "." + DecodeRadix50(load_little_u16(raw.data() + nNameWords * 2)).Trim();
+	});
 }
 
 Blob Volume::EncodeFilenamePart(RCString s) {
 	return Encoding->GetBytes(s);
 }
 
-Volume::CFiles::iterator Volume::FindEntry(const String& filename) {
-	auto it = Files.begin();
-	for (; it != Files.end(); ++it) {
-		if (CaseSensitive) {
-			if (!it->FileName.compare(filename))
-				return it;
-		} else if (!it->FileName.CompareNoCase(filename))
-			return it;
+EntryId DirEntry::Id() const {
+	size_t h = hash<wstring>()(wstring((const wchar_t*)FileName));
+	for (uint64_t v : { DirEntryDiskOffset, FirstCluster, (uint64_t)Length, (uint64_t)CreationTime.Ticks, (uint64_t)LastWriteTime.Ticks, (uint64_t)Aux1, (uint64_t)IsDirectory })
+		h ^= hash<uint64_t>()(v) + 0x9E3779B9 + (h << 6) + (h >> 2);
+	return h;
+}
+
+void DirTable::clear() {
+	names_.clear();
+	nameEnds_.clear();
+	lengths_.clear();
+	creationTimes_.clear();
+	lastWriteTimes_.clear();
+	firstClusters_.clear();
+	aux1_.clear();
+	flags_.clear();
+	rareTimes_.clear();
+}
+
+void DirTable::reserve(size_t n) {
+	names_.reserve(n * 12);
+	nameEnds_.reserve(n);
+	lengths_.reserve(n);
+	creationTimes_.reserve(n);
+	lastWriteTimes_.reserve(n);
+	firstClusters_.reserve(n);
+	aux1_.reserve(n);
+	flags_.reserve(n);
+}
+
+DirTable::Index DirTable::Add(const DirEntry& e) {
+	if (size() >= npos)
+		Throw(errc::file_too_large);
+	Index i = (Index)size();
+	const wchar_t* name = e.FileName;
+	names_.insert(names_.end(), name, name + e.FileName.length());
+	nameEnds_.push_back((uint32_t)names_.size());
+	lengths_.push_back(e.Length);
+	creationTimes_.push_back(e.CreationTime.Ticks);
+	lastWriteTimes_.push_back(e.LastWriteTime.Ticks);
+	firstClusters_.push_back(e.FirstCluster);
+	aux1_.push_back(e.Aux1);
+	flags_.push_back(uint8_t((e.IsDirectory ? FlagDirectory : 0)
+		| (e.IsArchive ? FlagArchive : 0)
+		| (e.IsSystem ? FlagSystem : 0)
+		| (e.IsVolumeLabel ? FlagVolumeLabel : 0)
+		| (e.Hidden ? FlagHidden : 0)
+		| (e.ReadOnly ? FlagReadOnly : 0)
+		| (e.Empty ? FlagEmpty : 0)));
+	if (e.LastAccessTime.Ticks || e.ExpirationTime.Ticks || e.BackupTime.Ticks)
+		rareTimes_[i] = RareTimes{ e.LastAccessTime.Ticks, e.ExpirationTime.Ticks, e.BackupTime.Ticks };
+	return i;
+}
+
+String DirTable::FileName(Index i) const {
+	uint32_t beg = i ? nameEnds_[i - 1] : 0;
+	return String(names_.data() + beg, nameEnds_[i] - beg);
+}
+
+DirEntry DirTable::operator[](Index i) const {
+	DirEntry e;
+	e.FileName = FileName(i);
+	e.Length = lengths_[i];
+	e.CreationTime = DateTime(creationTimes_[i]);
+	e.LastWriteTime = DateTime(lastWriteTimes_[i]);
+	e.FirstCluster = firstClusters_[i];
+	e.Aux1 = aux1_[i];
+	uint8_t flags = flags_[i];
+	e.IsDirectory = flags & FlagDirectory;
+	e.IsArchive = flags & FlagArchive;
+	e.IsSystem = flags & FlagSystem;
+	e.IsVolumeLabel = flags & FlagVolumeLabel;
+	e.Hidden = flags & FlagHidden;
+	e.ReadOnly = flags & FlagReadOnly;
+	e.Empty = flags & FlagEmpty;
+	if (auto it = rareTimes_.find(i); it != rareTimes_.end()) {
+		e.LastAccessTime = DateTime(it->second.LastAccess);
+		e.ExpirationTime = DateTime(it->second.Expiration);
+		e.BackupTime = DateTime(it->second.Backup);
 	}
-	return it;
+	return e;
+}
+
+size_t DirTable::MemoryUsage() const {
+	return names_.capacity() * sizeof(wchar_t)
+		+ nameEnds_.capacity() * sizeof(uint32_t)
+		+ (lengths_.capacity() + creationTimes_.capacity() + lastWriteTimes_.capacity()) * sizeof(int64_t)
+		+ firstClusters_.capacity() * sizeof(uint64_t)
+		+ aux1_.capacity() * sizeof(uint32_t)
+		+ flags_.capacity()
+		+ rareTimes_.size() * (sizeof(RareTimes) + sizeof(Index) + 2 * sizeof(void*));
+}
+
+template <class T> static void WriteColumn(Stream& stm, const vector<T>& v) {
+	uint32_t n = (uint32_t)v.size();
+	stm.WriteBuffer(&n, sizeof n);
+	stm.WriteBuffer(v.data(), n * sizeof(T));
+}
+
+template <class T> static void ReadColumn(const Stream& stm, vector<T>& v, size_t expected = SIZE_MAX) {
+	uint32_t n;
+	stm.ReadExactly(&n, sizeof n);
+	if (expected != SIZE_MAX ? n != expected : n > (stm.Length - stm.Position) / sizeof(T))
+		Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+	v.resize(n);
+	stm.ReadExactly(v.data(), n * sizeof(T));
+}
+
+void DirTable::Save(Stream& stm) const {
+	WriteColumn(stm, names_);
+	WriteColumn(stm, nameEnds_);
+	WriteColumn(stm, lengths_);
+	WriteColumn(stm, creationTimes_);
+	WriteColumn(stm, lastWriteTimes_);
+	WriteColumn(stm, firstClusters_);
+	WriteColumn(stm, aux1_);
+	WriteColumn(stm, flags_);
+	vector<pair<Index, RareTimes>> rare(rareTimes_.begin(), rareTimes_.end());
+	WriteColumn(stm, rare);
+}
+
+void DirTable::Load(const Stream& stm) {
+	clear();
+	ReadColumn(stm, names_);
+	ReadColumn(stm, nameEnds_);
+	auto n = nameEnds_.size();
+	ReadColumn(stm, lengths_, n);
+	ReadColumn(stm, creationTimes_, n);
+	ReadColumn(stm, lastWriteTimes_, n);
+	ReadColumn(stm, firstClusters_, n);
+	ReadColumn(stm, aux1_, n);
+	ReadColumn(stm, flags_, n);
+	vector<pair<Index, RareTimes>> rare;
+	ReadColumn(stm, rare);
+	rareTimes_.insert(rare.begin(), rare.end());
+	for (size_t i = 0; i < n; ++i)
+		if (nameEnds_[i] > names_.size() || (i && nameEnds_[i] < nameEnds_[i - 1]))
+			Throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+}
+
+wstring Volume::FilesIndexKey(RCString filename) const {
+	return wstring((const wchar_t*)(CaseSensitive ? filename : filename.ToUpper()));
+}
+
+bool Volume::NameMatches(const DirEntry& e, RCString filename) const {
+	return CaseSensitive ? !e.FileName.compare(filename) : !e.FileName.CompareNoCase(filename);
+}
+
+void Volume::RebuildFilesIndex() {
+	filesIndex_.clear();
+	filesIndex_.reserve(Files.size());
+	idIndex_.clear();
+	idIndex_.reserve(Files.size());
+	for (size_t i = Files.size(); i--;) {							// The first of duplicate names wins, as with a linear scan
+		filesIndex_[FilesIndexKey(Files[i].FileName)] = i;
+		auto r = idIndex_.emplace(Files[i].Id(), i);
+		if (!r.second)
+			r.first->second = SIZE_MAX;
+	}
+	filesIndexData_ = Files.data();
+	filesIndexSize_ = Files.size();
+	filesIndexCaseSensitive_ = CaseSensitive;
+	filesIndexValid_ = true;
+}
+
+void Volume::EnsureFilesIndex() {
+	if (!filesIndexValid_ || filesIndexData_ != Files.data() || filesIndexSize_ != Files.size() || filesIndexCaseSensitive_ != CaseSensitive)
+		RebuildFilesIndex();
+}
+
+Volume::CFiles::iterator Volume::Resolve(EntryId id) {
+	for (int pass = 0; pass < 2; ++pass) {
+		EnsureFilesIndex();
+		auto it = idIndex_.find(id);
+		if (it == idIndex_.end() || it->second == SIZE_MAX)
+			break;
+		if (Files[it->second].Id() == id)
+			return Files.begin() + it->second;
+		filesIndexValid_ = false;										// Modified in place
+	}
+	return Files.end();
+}
+
+Volume::CFiles::iterator Volume::FindEntry(const String& filename) {
+	EnsureFilesIndex();
+	auto it = filesIndex_.find(FilesIndexKey(filename));
+	if (it == filesIndex_.end())
+		return Files.end();
+	if (NameMatches(Files[it->second], filename))						// Verify: entries may be modified in place
+		return Files.begin() + it->second;
+	filesIndexValid_ = false;
+	for (auto i = Files.begin(); i != Files.end(); ++i)				// Case folding differs from CompareNoCase()
+		if (NameMatches(*i, filename))
+			return i;
+	return Files.end();
 }
 
 Volume::CFiles::iterator Volume::GetEntry(const String& filename) {
@@ -70,7 +555,11 @@ void Volume::ChangeDirectory(RCString name) {
 }
 
 void Volume::EnsureWriteMode() {
-	if (!_openedForModifying) {
+	if (!_openedForModifying && !overlay_) {
+		if (Compressed)
+			Throw(errc::read_only_file_system);
+		Cache.Invalidate();
+		Mapping.Close();				// Writes go through Fs, the mapping would block reopening for writing
 		Fs.Close();
 		try {
 			Fs.Open(filepath_, FileMode::Open, FileAccess::ReadWrite);
@@ -81,6 +570,359 @@ void Volume::EnsureWriteMode() {
 	}
 }
 
+void Volume::ReadAt(uint64_t offset, void* buf, size_t size) {
+	if (!size)
+		return;
+	if (!Cache.Budget() || Mapping.IsOpen()) {
+		if (ReadImage(offset, buf, size) != size)
+			Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+		return;
+	}
+	const uint64_t secSize = SectorCache::SectorSize;
+	auto p = (uint8_t*)buf;
+	auto end = offset + size;
+	vector<uint8_t> run;
+	for (uint64_t sec = offset / secSize, lastSec = (end - 1) / secSize; sec <= lastSec;) {
+		uint64_t nSec = 1;
+		const uint8_t* data = Cache.Find(sec);
+		if (data)
+			++Cache.Hits;
+		else {														// Read all consecutive missing sectors at once
+			while (sec + nSec <= lastSec && !Cache.Contains(sec + nSec))
+				++nSec;
+			Cache.Misses += nSec;
+			run.resize(size_t((nSec + ReadAhead(sec, nSec)) * secSize));
+			auto cb = ReadImage(sec * secSize, run.data(), run.size());
+			if (sec * secSize + cb < min(end, (sec + nSec) * secSize))
+				Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+			for (size_t i = 0; i < cb / secSize; ++i)				// Partial last sector of the image is not cached
+				Cache.Put(sec + i, run.data() + i * secSize);
+			data = run.data();
+		}
+		auto from = max(offset, sec * secSize)
+			, to = min(end, (sec + nSec) * secSize);
+		memcpy(p + (from - offset), data + (from - sec * secSize), size_t(to - from));
+		sec += nSec;
+	}
+}
+
+// Returns the number of sectors to prefetch after a miss of [sec, sec + nSec)
+uint64_t Volume::ReadAhead(uint64_t sec, uint64_t nSec) {
+	const uint64_t secSize = SectorCache::SectorSize
+		, minWindow = 8;
+	auto limit = min((uint64_t)ReadAheadLimit, (uint64_t)Cache.Budget() / 4) / secSize;	// Prefetch must not evict the working set
+	readAheadWindow_ = sec == readAheadEnd_ && limit ? min(limit, max(readAheadWindow_ * 2, minWindow)) : 0;
+	uint64_t n = 0;
+	while (n < readAheadWindow_ && !Cache.Contains(sec + nSec + n))
+		++n;
+	readAheadEnd_ = sec + nSec + n;
+	return n;
+}
+
+uint64_t Volume::ImageLength() {
+	return Compressed ? Compressed->Length()
+		: Mapping.IsOpen() ? Mapping.View().size()
+		: (uint64_t)Fs.Length;
+}
+
+size_t Volume::ReadImage(uint64_t offset, void* buf, size_t size) {
+	auto p = (uint8_t*)buf;
+	size_t r = 0;
+	if (Compressed)
+		r = Compressed->ReadAt(offset, buf, size);
+	else if (Mapping.IsOpen()) {
+		auto view = Mapping.View();
+		if (offset < view.size()) {
+			r = (size_t)min((uint64_t)size, view.size() - offset);
+			memcpy(p, view.data() + offset, r);
+		}
+	} else {
+		Fs.Position = offset;
+		for (size_t cb; r < size && (cb = Fs.Read(p + r, size - r)); r += cb)
+			;
+	}
+	Stats.OnRead(offset, r);
+	if (!Overlay.empty()) {
+		if (offset + size > Overlay.End)
+			size = (size_t)max(offset, Overlay.End) - offset;
+		if (r < size)
+			memset(p + r, 0, size - r);								// Overlay sectors past the end of the image
+		Overlay.Apply(offset, p, r = max(r, size));
+	}
+	return r;
+}
+
+SectorView Volume::ReadView(uint64_t offset, size_t size) {
+	if (!Mapping.IsOpen() || Overlay.Overlaps(offset, size)) {
+		vector<uint8_t> buf(size);
+		ReadAt(offset, buf.data(), size);
+		return SectorView(std::move(buf));
+	}
+	auto view = Mapping.View();
+	if (offset > view.size() || view.size() - offset < size)
+		Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+	Stats.OnRead(offset, size);
+	return SectorView(view.subspan((size_t)offset, size));
+}
+
+vector<Extent> Volume::MergeExtents(const vector<Extent>& extents) {
+	vector<Extent> r;
+	for (auto& x : extents) {
+		if (!r.empty() && r.back().Lba + r.back().Count == x.Lba)
+			r.back().Count += x.Count;
+		else if (x.Count)
+			r.push_back(x);
+	}
+	return r;
+}
+
+void Volume::CopyExtentsTo(const vector<Extent>& extents, uint64_t len, Stream& os) {
+	const size_t maxChunk = 1024 * 1024
+		, maxMappedChunk = 64 * 1024 * 1024;
+	vector<uint8_t> buf;
+	for (auto& run : MergeExtents(extents)) {
+		if (!len)
+			break;
+		auto cbRun = min(len, run.Count * BytesPerSector);
+		len -= cbRun;
+		if (Mapping.IsOpen()) {												// Write straight from the mapped image pages, no intermediate buffer
+			auto view = ReadView(run.Lba * BytesPerSector, (size_t)cbRun);
+			for (size_t off = 0, cb; off < view.size(); off += cb) {
+				cb = min(view.size() - off, maxMappedChunk);
+				os.WriteBuffer(view.data() + off, cb);
+			}
+			continue;
+		}
+		for (auto off = run.Lba * BytesPerSector; cbRun;) {			// File contents bypass the sector cache
+			auto cb = (size_t)min(cbRun, (uint64_t)maxChunk);
+			if (buf.size() < cb)
+				buf.resize(cb);
+			if (ReadImage(off, buf.data(), cb) != cb)
+				Throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+			os.WriteBuffer(buf.data(), cb);
+			off += cb;
+			cbRun -= cb;
+		}
+	}
+	if (len)
+		Throw(HRESULT_FROM_WIN32(ERROR_DISK_CORRUPT));
+}
+
+void Volume::CopyFileTo(const DirEntry& fileEntry, Stream& os) {
+	auto timer = Stats.Time(VolumeOp::CopyFileTo);
+	WriteFilePrefix(fileEntry, os);
+	CopyExtentsTo(GetFileExtents(fileEntry), fileEntry.Length, os);
+}
+
+unique_ptr<Stream> Volume::OpenFile(const DirEntry& fileEntry) {
+	auto r = make_unique<MemoryStream>();
+	CopyFileTo(fileEntry, *r);
+	r->Position = 0;
+	return r;
+}
+
+const vector<DirEntry>& Volume::CachedListing(uint32_t dirId, bool bWithExtra) {
+	auto key = make_pair(dirId, bWithExtra);
+	if (listingsGeneration_ != generation_ || (listings_.size() >= MaxCachedListings && !listings_.count(key))) {
+		listings_.clear();
+		listingsGeneration_ = generation_;
+	}
+	auto it = listings_.find(key);
+	if (it == listings_.end())
+		it = listings_.emplace(key, GetDirEntries(dirId, bWithExtra)).first;
+	return it->second;
+}
+
+vector<DirEntry> Volume::ListDirectory(uint32_t dirId, bool bWithExtra) {
+	return CachedListing(dirId, bWithExtra);
+}
+
+optional<DirEntry> Volume::Lookup(RCString path) {
+	const wchar_t* p = path;
+	uint32_t dirId = RootDirectoryId();
+	const DirEntry* found = nullptr;
+	for (size_t i = 0, beg = 0, len = path.length(); i <= len; ++i) {
+		if (i < len && p[i] != '\\' && p[i] != '/')
+			continue;
+		if (i == beg) {									// Leading, doubled or trailing separator
+			beg = i + 1;
+			continue;
+		}
+		if (found) {
+			if (!found->IsDirectory)
+				return nullopt;
+			dirId = SubdirectoryId(*found);
+		}
+		String name(p + beg, i - beg);
+		beg = i + 1;
+		found = nullptr;
+		for (auto& e : CachedListing(dirId, false))
+			if (NameMatches(e, name)) {
+				found = &e;
+				break;
+			}
+		if (!found)
+			return nullopt;
+	}
+	return found ? optional<DirEntry>(*found) : nullopt;
+}
+
+wstring VolumeSnapshot::Key(RCString path) const {
+	wstring r((const wchar_t*)(caseSensitive_ ? path : path.ToUpper()));
+	replace(r.begin(), r.end(), L'/', L'\\');
+	r.erase(0, r.find_first_not_of(L'\\'));
+	return r;
+}
+
+const VolumeSnapshot::Node* VolumeSnapshot::Find(RCString path) const {
+	auto it = pathIndex_.find(Key(path));
+	return it == pathIndex_.end() ? nullptr : &Nodes[it->second];
+}
+
+span<const VolumeSnapshot::Node> VolumeSnapshot::Children(const Node* dir) const {
+	return dir
+		? span<const Node>(Nodes.data() + dir->FirstChild, dir->ChildCount)
+		: span<const Node>(Nodes.data(), RootCount);
+}
+
+shared_ptr<const VolumeSnapshot> Volume::Snapshot() {
+	const int maxLevels = 100;
+	const auto npos = VolumeSnapshot::npos;
+	auto r = make_shared<VolumeSnapshot>();
+	r->caseSensitive_ = CaseSensitive;
+	struct Pending {
+		uint32_t DirId, Node;						// Node == npos for the root directory
+		int Level;
+	};
+	deque<Pending> queue = { Pending{ RootDirectoryId(), npos, 0 } };
+	unordered_set<uint32_t> visited = { RootDirectoryId() };		// Guards against loops in corrupted trees
+	bool mapsFiles = true;
+	while (!queue.empty()) {
+		auto cur = queue.front();
+		queue.pop_front();
+		if (cur.Level > maxLevels)
+			Throw(ExtErr::RecursionTooDeep);
+		auto first = (uint32_t)r->Nodes.size();
+		for (auto& e : CachedListing(cur.DirId, false)) {
+			if (e.Empty || e.IsVolumeLabel || e.FileName == "." || e.FileName == "..")
+				continue;
+			VolumeSnapshot::Node node;
+			node.Entry = e;
+			node.Path = cur.Node == npos ? e.FileName : r->Nodes[cur.Node].Path + "\\" + e.FileName;
+			node.Parent = cur.Node;
+			r->Nodes.push_back(node);
+		}
+		auto end = (uint32_t)r->Nodes.size();
+		if (cur.Node == npos)
+			r->RootCount = end - first;
+		else {
+			r->Nodes[cur.Node].FirstChild = first;
+			r->Nodes[cur.Node].ChildCount = end - first;
+		}
+		for (auto i = first; i < end; ++i) {
+			auto& node = r->Nodes[i];
+			if (node.Entry.IsDirectory) {
+				auto dirId = SubdirectoryId(node.Entry);
+				if (visited.insert(dirId).second)
+					queue.push_back(Pending{ dirId, i, cur.Level + 1 });
+			} else if (mapsFiles) {
+				try {
+					auto extents = GetFileExtents(node.Entry);
+					node.FirstExtent = (uint32_t)r->Extents.size();
+					node.ExtentCount = (uint32_t)extents.size();
+					r->Extents.insert(r->Extents.end(), extents.begin(), extents.end());
+				} catch (Exception& ex) {
+					if (ex.code() == error_code(E_NOTIMPL, hresult_category()))
+						mapsFiles = false;
+					else {												// Damaged chain: list the file anyway, copying it reports the error
+						TRC(1, "No extents for " << node.Path << ": " << ex.what());
+						node.ExtentCount = 0;
+					}
+				}
+			}
+		}
+	}
+	r->pathIndex_.reserve(r->Nodes.size());
+	for (uint32_t i = 0; i < r->Nodes.size(); ++i)
+		r->pathIndex_.emplace(r->Key(r->Nodes[i].Path), i);
+	return r;
+}
+
+void Volume::WriteAt(uint64_t offset, RCSpan s) {
+	++generation_;
+	const uint64_t secSize = SectorCache::SectorSize;
+	const size_t directWriteSize = 64 * 1024;						// File contents are not worth buffering
+	if (!overlay_ && (!WriteBackLimit || s.size() >= directWriteSize)) {
+		Overlay.Update(offset, s);									// Keep buffered copies current
+		Fs.Write(offset, s);
+		Stats.OnWrite(offset, s.size());
+	} else {
+		for (uint64_t off = offset, end = offset + s.size(); off < end;) {
+			auto sec = off / secSize;
+			auto p = Overlay.Find(sec);
+			if (!p) {
+				SectorOverlay::CSector data = {};
+				if (off != sec * secSize || end - off < secSize) {		// Partial sector: read-modify-write
+					if (auto cached = Cache.Find(sec))
+						memcpy(data.data(), cached, secSize);
+					else
+						ReadImage(sec * secSize, data.data(), secSize);
+				}
+				p = &Overlay.Insert(sec, data);
+			}
+			auto to = min(end, (sec + 1) * secSize);
+			memcpy(p->data() + (off - sec * secSize), s.data() + (off - offset), size_t(to - off));
+			off = to;
+		}
+		Overlay.End = max(Overlay.End, offset + s.size());
+	}
+	Cache.Update(offset, s);
+	if (!overlay_ && Overlay.size() * secSize >= WriteBackLimit)
+		WriteBack();
+}
+
+void Volume::WriteBack() {
+	if (Overlay.empty())
+		return;
+	auto end = max(ImageLength(), Overlay.End);					// Don't extend the image by padding of the last sector
+	Overlay.ForEachRun(1024 * 1024, [this, end](uint64_t offset, RCSpan s) {
+		auto cb = (size_t)min((uint64_t)s.size(), end - offset);
+		Fs.Write(offset, s.subspan(0, cb));
+		Stats.OnWrite(offset, cb);
+	});
+	Overlay.Clear();
+}
+
+void Volume::Commit() {
+	if (Overlay.empty())
+		return;
+	overlay_ = false;
+	try {
+		EnsureWriteMode();
+		WriteBack();
+		Fs.Flush();
+	} catch (exception&) {
+		overlay_ = true;
+		throw;
+	}
+	overlay_ = true;
+}
+
+void Volume::Discard() {
+	if (!overlay_ || Overlay.empty())
+		return;
+	Overlay.Clear();
+	Cache.Invalidate();
+	++generation_;
+	ReloadMetadata();
+}
+
+void Volume::WriteAt(uint64_t offset, Stream& istm) {
+	vector<uint8_t> buf(64 * 1024);
+	for (size_t cb; (cb = istm.Read(buf.data(), buf.size())) != 0; offset += cb)
+		WriteAt(offset, Span(buf.data(), cb));
+}
+
 uint64_t Volume::CalcNumberOfClusters(uint64_t len) {
 	if (0 == len)
 		return len;
@@ -88,11 +930,22 @@ uint64_t Volume::CalcNumberOfClusters(uint64_t len) {
 	return (len + clusterSize - 1) / clusterSize;
 }
 
+vector<DirEntry> Volume::GetDirEntries(uint32_t cluster, bool bWithExtra) {
+	vector<DirEntry> r;
+	EnumDirEntries(cluster, bWithExtra, [&r](const DirEntry& e) {
+		r.push_back(e);
+		return true;
+	});
+	return r;
+}
+
 uint64_t Volume::FindFreeContiguousArea(uint64_t nClusters) {
 	map<uint64_t, uint64_t> map;		// start/len pairs
-	for (const auto& e : GetDirEntries(0, true))
+	EnumDirEntries(0, true, [this, &map](const DirEntry& e) {
 		if (!e.Empty && !e.IsDirectory && e.FirstCluster)
 			map.insert(make_pair(e.FirstCluster, CalcNumberOfClusters(e.Length)));
+		return true;
+	});
 	auto cur = FirstDataCluster;
 	for (const auto kv : map) {
 		if (kv.first < cur)
@@ -137,6 +990,7 @@ void Volume::SaveDirEntries(const CFiles& entries) {
 }
 
 void Volume::ModifyFile(RCString filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp) {
+	auto timer = Stats.Time(VolumeOp::ModifyFile);
 	EnsureWriteMode();
 	DirEntry e;
 	len = AdjustLengthOnPut(istm, e, len);
@@ -154,8 +1008,7 @@ void Volume::ModifyFile(RCString filename, uint64_t len, Stream& istm, const Dat
 			if (!(firstCluster = FindFreeContiguousArea(nClusters)))
 				Throw(errc::no_space_on_device);
 		}
-		Fs.Position = (uint64_t)firstCluster * SectorsPerCluster * BytesPerSector;
-		istm.CopyTo(Fs);
+		WriteAt((uint64_t)firstCluster * SectorsPerCluster * BytesPerSector, istm);
 	}
 	e.FileName = filename;
 	e.FirstCluster = firstCluster;
@@ -175,11 +1028,14 @@ void Volume::AddFile(const String& filename, uint64_t len, Stream& istm, const D
 void Volume::RemoveFileChecks(RCString filename) {
 	EnsureWriteMode();
 	auto& e = *GetEntry(filename);
-	if (e.IsDirectory && !GetDirEntries((uint32_t)e.FirstCluster, false).empty())
+	if (e.IsDirectory && !EnumDirEntries((uint32_t)e.FirstCluster, false, [](const DirEntry&) { return false; }))
 		Throw(errc::directory_not_empty);
 }
 
+// The cache is write-through, so it stays valid after Flush()
 void Volume::Flush() {
+	if (!overlay_)
+		WriteBack();
 	if (_openedForModifying)
 		Fs.Flush();
 }
@@ -197,12 +1053,44 @@ IVolumeFactory* IVolumeFactory::FindBestFactory(const Span& s) {
 	return bestFactory;
 }
 
-unique_ptr<Volume> IVolumeFactory::Mount(const path& p) {
+IVolumeFactory* IVolumeFactory::FindBestFactory(const path& p) {
 	vector<uint8_t> buf(128 * 1024);
-	auto cb = FileStream(p, FileMode::Open, FileAccess::Read).Read(buf.data(), buf.size());
-	if (auto factory = FindBestFactory(Span(buf.data(), cb))) {
+	size_t cb = FileStream(p, FileMode::Open, FileAccess::Read).Read(buf.data(), buf.size());
+	if (CompressedImage::IsCompressed(Span(buf.data(), cb)))			// The index is built only by mounting
+		cb = CompressedImage::ReadHead(p, buf.data(), buf.size());
+	return FindBestFactory(Span(buf.data(), cb));
+}
+
+unique_ptr<Volume> IVolumeFactory::Mount(const path& p) {
+	optional<MetadataCache> cache;
+	if (MetadataCache::Enabled) {
+		try {
+			cache.emplace(p);
+		} catch (exception&) {
+			cache.reset();
+		}
+	}
+	if (cache && cache->Load()) {
+		try {
+			for (auto factory : RegisteredFactories())
+				if (cache->FactoryName == typeid(*factory).name()) {
+					auto volume = factory->CreateInstance();
+					volume->UseMetadata(&*cache);
+					volume->Init(p);
+					volume->UseMetadata(nullptr);
+					return volume;
+				}
+		} catch (exception&) {											// Stale or inconsistent cache: probe and parse again
+			TRC(1, "Ignoring cached metadata of " << p);
+		}
+	}
+	if (auto factory = FindBestFactory(p)) {
 		auto volume = factory->CreateInstance();
 		volume->Init(p);
+		if (cache) {
+			cache->FactoryName = typeid(*factory).name();
+			volume->CacheMetadata(*cache);
+		}
 		return volume;
 	}
 	Throw(HRESULT_FROM_WIN32(ERROR_UNRECOGNIZED_VOLUME));
@@ -184,6 +184,7 @@ extern "C" intptr_t WINAPI FarGetFindDataW(GetFindDataInfo& info) {
 			if (file.LastAccessTime.Ticks)
 				item.LastWriteTime = file.LastAccessTime;
 
+			item.UserData.Data = (void*)file.Id();
 			item.FileSize = file.Length;
 			item.AllocationSize = file.AllocationSize ? file.AllocationSize : file.Length;
 			item.NumberOfLinks = 1;
@@ -227,7 +228,9 @@ extern "C" intptr_t WINAPI FarMakeDirectoryW(const MakeDirectoryInfo& info) {
 	if (info.StructSize < sizeof(MakeDirectoryInfo))
 		return 0;
 	try {
-		((Volume*)info.hPanel)->MakeDirectory(info.Name);
+		auto& volume = *(Volume*)info.hPanel;
+		volume.MakeDirectory(info.Name);
+		volume.Flush();
 		return 1;
 	} catch (exception& ex) {
 		return ShowErrorMessage(ex);
@@ -350,19 +353,31 @@ static class FarVolumeCallback : public IVolumeCallback
 
 #pragma FAR_EXPORT(AnalyseW)
 extern "C" HANDLE WINAPI FarAnalyseW(const AnalyseInfo& info) {
-	if (auto factory = IVolumeFactory::FindBestFactory(Span((const uint8_t*)info.Buffer, info.BufferSize))) {
-		auto volume = factory->CreateInstance();
-		try {
+	Span head((const uint8_t*)info.Buffer, info.BufferSize);
+	try {
+		if (auto factory = CompressedImage::IsCompressed(head) ? IVolumeFactory::FindBestFactory(path(info.FileName)) : IVolumeFactory::FindBestFactory(head)) {
+			auto volume = factory->CreateInstance();
 			volume->Callback = &s_farVolumeCallback;
 			volume->Init(info.FileName);
 			return volume.release();
-		} catch (exception& ex) {
-			ShowErrorMessage(ex);
 		}
+	} catch (exception& ex) {
+		ShowErrorMessage(ex);
 	}
 	return nullptr;
 }
 
+// Panel items carry the EntryId of their DirEntry; the name is the fallback for ids gone stale
+static const DirEntry* FindPanelEntry(Volume& volume, const PluginPanelItem& item) {
+	auto it = volume.Resolve((EntryId)item.UserData.Data);
+	if (it != volume.Files.end() && it->FileName == item.FileName)
+		return &*it;
+	for (auto& file : volume.Files)
+		if (file.FileName == item.FileName)
+			return &file;
+	return nullptr;
+}
+
 #pragma FAR_EXPORT(GetFilesW)
 extern "C" intptr_t WINAPI FarGetFilesW(GetFilesInfo& info) {
 	if (info.StructSize < sizeof(GetFilesInfo))
@@ -379,47 +394,73 @@ extern "C" intptr_t WINAPI FarGetFilesW(GetFilesInfo& info) {
 			}
 
 			auto& volume = *(Volume*)info.hPanel;
-			const auto& files = volume.Files;
-			bool bReadOnly = true;
+			struct PendingCopy {
+				const DirEntry* Entry;
+				path DstPath;
+				bool Created;
+			};
+			vector<PendingCopy> pending;
+			vector<String> movedNames;
 			for (size_t i = 0; i < info.ItemsNumber; ++i) {
 				auto& item = info.PanelItem[i];
-				for (auto& file : files) {
-					if (file.FileName == item.FileName) {
-						String dstFilename = item.FileName;
-						dstFilename.Replace("/", "_");
-						dstFilename.Replace("\\", "_");
-						path dstPath = path(info.DestPath) / dstFilename;
-						if (exists(dstPath)) {
-							FARMESSAGEFLAGS flags = FMSG_WARNING | FMSG_MB_YESNOCANCEL;
-							String sDstPath = dstPath;
-							const wchar_t* messages[4] = { L"Warning", L"File already exists", sDstPath, L"Override?" };
-							auto res = Far.Message(&c_guidFsPlugin, &c_overwrite_dialog_guid, flags, nullptr, messages, 4, 0);
-							switch (res) {
-							case 0:
-								break;
-							case 1:
-								continue;
-							case -1:
-							case 2:
-								return -1;
-							}
-						}
-						FileStream ofs(dstPath, FileMode::Create, FileAccess::Write);
-						volume.CopyFileTo(file, ofs);
-						/*!!!R
-						FileSystemInfo fileInfo(path(destPath), false);
-						fileInfo.CreationTime = file.CreationTime;
-						fileInfo.LastWriteTime = file.CreationTime;
-						*/
-						if (info.Move) {
-							volume.RemoveFile(item.FileName);
-							bReadOnly = false;
-						}
+				auto pFile = FindPanelEntry(volume, item);
+				if (!pFile)
+					continue;
+				auto& file = *pFile;
+				String dstFilename = item.FileName;
+				dstFilename.Replace("/", "_");
+				dstFilename.Replace("\\", "_");
+				path dstPath = path(info.DestPath) / dstFilename;
+				if (exists(dstPath)) {
+					FARMESSAGEFLAGS flags = FMSG_WARNING | FMSG_MB_YESNOCANCEL;
+					String sDstPath = dstPath;
+					const wchar_t* messages[4] = { L"Warning", L"File already exists", sDstPath, L"Override?" };
+					auto res = Far.Message(&c_guidFsPlugin, &c_overwrite_dialog_guid, flags, nullptr, messages, 4, 0);
+					switch (res) {
+					case 0:
 						break;
+					case 1:
+						continue;
+					case -1:
+					case 2:
+						return -1;
+					}
+				}
+				pending.push_back(PendingCopy{ &file, dstPath, !exists(dstPath) });		// Destinations are truncated only after all answers
+				/*!!!R
+				FileSystemInfo fileInfo(path(destPath), false);
+				fileInfo.CreationTime = file.CreationTime;
+				fileInfo.LastWriteTime = file.CreationTime;
+				*/
+				if (info.Move)
+					movedNames.push_back(item.FileName);
+			}
+			const size_t maxOpenFiles = 64;
+			vector<path> created;
+			try {
+				for (size_t beg = 0; beg < pending.size(); beg += maxOpenFiles) {
+					vector<unique_ptr<FileStream>> streams;
+					vector<CopyJob> jobs;
+					for (size_t i = beg; i < min(pending.size(), beg + maxOpenFiles); ++i) {
+						auto& pc = pending[i];
+						streams.push_back(make_unique<FileStream>(pc.DstPath, FileMode::Create, FileAccess::Write));
+						if (pc.Created)
+							created.push_back(pc.DstPath);
+						jobs.push_back(CopyJob{ pc.Entry, streams.back().get() });
 					}
+					volume.CopyFilesTo(jobs);
 				}
+			} catch (Exception& ex) {
+				if (ex.code() == errc::operation_canceled)
+					for (auto& p : created) {									// Never files that existed before this call
+						error_code ec;
+						remove(p, ec);
+					}
+				throw;
 			}
-			if (!bReadOnly)
+			for (auto& name : movedNames)
+				volume.RemoveFile(name);
+			if (!movedNames.empty())
 				volume.Flush();
 			return 1;
 		} catch (Exception& ex) {
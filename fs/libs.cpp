@@ -1,6 +1,7 @@
 #pragma comment(lib, "psapi.lib")
 #pragma comment(lib, "libext.lib")
 #pragma comment(lib, "gui.lib")
+#pragma comment(lib, "zlib.lib")
 
 #ifdef _DEBUG
 #	pragma comment(lib, "libcmtd")
@@ -105,13 +105,11 @@ STDMETHODIMP CDataObject::GetData(FORMATETC* pFormatetc, STGMEDIUM* pMedium) MET
 
 		const FILEDESCRIPTOR& fd = m_aFiles[iIndex];
 
-		unique_ptr<MemoryStream> pMS(new MemoryStream);
 		auto& entry = *Vol->GetEntry(fd.cFileName);
-		Vol->CopyFileTo(entry, *pMS);
-		pMS->Position = 0;
+		auto stm = Vol->OpenFile(entry);
 
 		// Let's initialize the Stream...
-		CreateComInstance<CComStream>(&pMedium->pstm, pMS.release(), entry.FileName, entry.CreationTime);
+		CreateComInstance<CComStream>(&pMedium->pstm, stm.release(), entry.FileName, entry.CreationTime);
 		pMedium->tymed = TYMED_ISTREAM;
 		return S_OK;
 	} else if (pFormatetc->cfFormat == g_formatShellIdList.Id) {
@@ -291,7 +289,7 @@ void CDataObject::CollectFile(RCString name) {
 	m_aFiles.push_back(fd);
 }
 
-void CDataObject::Init(IShellExt* shellExt, CUnkPtr iShellExt, Volume* vol, HWND hWnd, LPCITEMIDLIST* pPidls, int nCount) {
+void CDataObject::Init(IShellExt* shellExt, CUnkPtr iShellExt, shared_ptr<Volume> vol, HWND hWnd, LPCITEMIDLIST* pPidls, int nCount) {
 	TRC(1, "");
 	if (nCount == 0)
 		Throw(E_INVALIDARG);
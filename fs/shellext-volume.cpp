@@ -249,7 +249,7 @@ private:
 	ShellPath _pathRoot, _pathMonitor, _pathPath;
 	String _path;
 
-	unique_ptr<Volume> volume_;
+	shared_ptr<Volume> volume_;
 
 	Volume& get_Volume() {
 		if (!volume_) {
@@ -460,6 +460,7 @@ public:
 
 	void CopyDroppedFile(Stream& streamFrom, RCString filenameTo, const DateTime& timestampCreation) {
 		Volume.AddFile(filenameTo, streamFrom.Length, streamFrom, timestampCreation);
+		Volume.Flush();
 	}
 
 	void CopyDroppedFile(RCString from, RCString to, DateTime timestampCreation = DateTime()) {
@@ -475,6 +476,7 @@ public:
 
 	void CreateDroppedDirectory(RCString name) {
 		Volume.MakeDirectory(name);
+		Volume.Flush();
 	}
 
 
@@ -590,11 +592,9 @@ public:
 			auto sPath = ShellPath(pidl).ToSimpleString();
 			TRC(1, "sPath: " << sPath);
 
-			unique_ptr<MemoryStream> pMS(new MemoryStream);
 			auto& entry = *Volume.GetEntry(sPath);
-			Volume.CopyFileTo(entry, *pMS);
-			pMS->Position = 0;
-			CreateComInstance<CComStream>((IStream**)ppv, pMS.release(), entry.FileName, entry.CreationTime);
+			auto stm = Volume.OpenFile(entry);
+			CreateComInstance<CComStream>((IStream**)ppv, stm.release(), entry.FileName, entry.CreationTime);
 			volume_.reset();
 		} else {
 			if (riid == IID_IShellFolder) {
@@ -681,7 +681,8 @@ public:
 */
 		} else if (riid == IID_IDataObject) {
 			TRC(1, "riid: IID_IDataObject, cidl: " << cidl);
-			CreateComInstance<CDataObject>((IDataObject**)ppRetVal, this, (IShellFolder*)this, &Volume, hwndOwner, apidl, cidl);
+			get_Volume();			// Mounts on demand
+			CreateComInstance<CDataObject>((IDataObject**)ppRetVal, this, (IShellFolder*)this, volume_, hwndOwner, apidl, cidl);
 			return S_OK;
 		}
 		TRC(1, "riid: " << riid);
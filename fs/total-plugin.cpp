@@ -52,48 +52,39 @@ extern "C" int __stdcall TotalGetPackerCaps() {
 #pragma TOTAL_EXPORT1(CanYouHandleThisFileW)
 extern "C" BOOL __stdcall TotalCanYouHandleThisFileW(WCHAR* FileName) {
 	try {
-		FileStream ifs(FileName, FileMode::Open, FileAccess::Read);
-		uint8_t buf[128 * 1024];
-		auto cb = ifs.Read(buf, sizeof(buf));
-		return IVolumeFactory::FindBestFactory(Span(buf, cb)) ? TRUE : FALSE;
-	} catch (Exception&) { return FALSE; }
+		return IVolumeFactory::FindBestFactory(path(FileName)) ? TRUE : FALSE;
+	} catch (exception&) { return FALSE; }
 }
 
 class FileEnumerator {
-	static const int MaxLevels = 100;
-
-	vector<DirEntry> entries;
+	vector<const VolumeSnapshot::Node*> files;
 	int idxCur = -1;
 
-	void CoolectEntries(RCString dir, int nLevel = 0) {
-		if (nLevel > MaxLevels)
-			Throw(ExtErr::RecursionTooDeep);
-		for (size_t i = 0; i < Vol->Files.size(); ++i) {
-			DirEntry e = Vol->Files[i];
-			auto relative = e.FileName;
-			e.FileName = !dir ? relative : dir + "\\" + relative;
-			if (e.IsDirectory) {
-				Vol->ChangeDirectory(relative);
-				CoolectEntries(e.FileName, nLevel + 1);
-				Vol->ChangeDirectory("..");
-			} else
-				entries.push_back(e);
+	void CollectFiles(const VolumeSnapshot::Node* dir) {
+		for (auto& node : Catalog->Children(dir)) {
+			if (node.Entry.IsDirectory)
+				CollectFiles(&node);
+			else
+				files.push_back(&node);
 		}
 	}
 public:
 	unique_ptr<Volume> Vol;
+	shared_ptr<const VolumeSnapshot> Catalog;
 
 	FileEnumerator(Volume *vol)
-		: Vol(vol) {
-		CoolectEntries(nullptr);
+		: Vol(vol)
+		, Catalog(Vol->Snapshot()) {
+		CollectFiles(nullptr);
 	}
 
-	const DirEntry& Cur() { return entries[idxCur]; }
+	const DirEntry& Cur() { return files[idxCur]->Entry; }
 
 	bool Next(DirEntry& e) {
-		if (idxCur >= (int)entries.size() - 1)
+		if (idxCur >= (int)files.size() - 1)
 			return false;
-		e = entries[++idxCur];
+		e = files[++idxCur]->Entry;
+		e.FileName = files[idxCur]->Path;
 		return true;
 	}
 };
@@ -211,13 +202,7 @@ static int ProcessFile(HANDLE hArcData, int Operation, RCString DestPath, RCStri
 	case PK_EXTRACT: {
 		path dest = !!DestPath ? path(DestPath.c_wstr()) / DestName : DestName.c_wstr();
 		FileStream ofs(dest, FileMode::CreateNew, FileAccess::Write);
-		auto e = fe.Cur();
-		auto parts = e.FileName.Split("\\");
-		volume.ChangeDirectory("/");
-		int i;
-		for (i = 0; i < parts.size() - 1; ++i)
-			volume.ChangeDirectory(parts[i]);
-		volume.CopyFileTo(*volume.GetEntry(parts[i]), ofs);
+		volume.CopyFileTo(fe.Cur(), ofs);
 	}
 	case PK_SKIP:
 		break;
@@ -253,6 +238,7 @@ extern "C" int	__stdcall TotalPackFilesW(WCHAR *PackedFile, WCHAR *SubPath, WCHA
 			FileStream ifs(SrcPath, FileMode::Open, FileAccess::Read);
 			vol->ModifyFile(dest, ifs.Length, ifs, creationTime);
 		}
+		vol->Flush();
 		if (Flags & PK_PACK_MOVE_FILES)
 			filesystem::remove(SrcPath);
 	} catch (Exception& ex) { return ToErrorCode(ex); }
@@ -264,10 +250,12 @@ extern "C" int	__stdcall TotalPackFilesW(WCHAR *PackedFile, WCHAR *SubPath, WCHA
 extern "C" int	__stdcall TotalDeleteFiles(CHAR *PackedFile, CHAR *DeleteList) {
 	try {
 		unique_ptr<Volume> vol = IVolumeFactory::Mount(PackedFile);
+		vol->BeginOverlay();				// All or nothing, each modified sector is written once
 		for (CHAR* p = DeleteList; *p;) {
 			vol->RemoveFile(p);
 			while (*p++);
 		}
+		vol->Commit();
 	} catch (Exception& ex) { return ToErrorCode(ex); }
 	return 0;
 }
@@ -276,10 +264,12 @@ extern "C" int	__stdcall TotalDeleteFiles(CHAR *PackedFile, CHAR *DeleteList) {
 extern "C" int	__stdcall TotalDeleteFilesW(WCHAR* PackedFile, WCHAR* DeleteList) {
 	try {
 		unique_ptr<Volume> vol = IVolumeFactory::Mount(PackedFile);
+		vol->BeginOverlay();				// All or nothing, each modified sector is written once
 		for (WCHAR* p = DeleteList; *p;) {
 			vol->RemoveFile(p);
 			while (*p++);
 		}
+		vol->Commit();
 	} catch (Exception& ex) { return ToErrorCode(ex); }
 	return 0;
 }
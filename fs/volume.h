@@ -12,6 +12,8 @@ extern const CodePageEncoding s_encodingKoi8;
 
 String DecodeRadix50(uint16_t w);
 
+typedef size_t EntryId;
+
 class DirEntry : public Object, CPersistent {
 public:
 	typedef NonInterlockedPolicy interlocked_policy;
@@ -27,7 +29,7 @@ public:
 	uint64_t FirstCluster = 0;
 	uint32_t Aux1 = 0, Aux2 = 0, Aux3 = 0;
 	int EntrySize = 0;
-	uint16_t Attrs;
+	uint16_t Attrs = 0;
 	bool Empty = false
 		, IsDirectory = false
 		, IsArchive = false
@@ -39,6 +41,9 @@ public:
 	void Read(const BinaryReader& rd) override;
 	void Write(BinaryWriter& wr) const override;
 
+	// Opaque handle derived from the entry location and attributes. Survives reloading of the directory, changes when the entry is modified
+	EntryId Id() const;
+
 	static DirEntry FromSpan(RCSpan s) {
 		CMemReadStream stm(s);
 		BinaryReader rd(stm);
@@ -48,6 +53,336 @@ public:
 	}
 };
 
+// Compact column-wise storage of many directory entries: names in one arena, attributes as bit flags, times as ticks.
+// Keeps only the fields listings need; Blobs, Aux2/Aux3 and entry location are not stored
+class DirTable {
+public:
+	typedef uint32_t Index;
+	static const Index npos = UINT32_MAX;
+
+	size_t size() const { return lengths_.size(); }
+	bool empty() const { return lengths_.empty(); }
+	void clear();
+	void reserve(size_t n);
+	Index Add(const DirEntry& e);
+
+	DirEntry operator[](Index i) const;		// Materializes the entry
+	String FileName(Index i) const;
+	int64_t Length(Index i) const { return lengths_[i]; }
+	uint64_t FirstCluster(Index i) const { return firstClusters_[i]; }
+	uint32_t Aux1(Index i) const { return aux1_[i]; }
+	bool IsDirectory(Index i) const { return flags_[i] & FlagDirectory; }
+
+	size_t MemoryUsage() const;
+
+	void Save(Stream& stm) const;
+	void Load(const Stream& stm);		// Throws on malformed data
+private:
+	enum : uint8_t {
+		FlagDirectory = 1
+		, FlagArchive = 2
+		, FlagSystem = 4
+		, FlagVolumeLabel = 8
+		, FlagHidden = 16
+		, FlagReadOnly = 32
+		, FlagEmpty = 64
+	};
+
+	// Times other than Creation/LastWrite are mostly zero, so they are kept aside
+	struct RareTimes {
+		int64_t LastAccess, Expiration, Backup;
+	};
+
+	vector<wchar_t> names_;
+	vector<uint32_t> nameEnds_;				// names_[nameEnds_[i - 1] .. nameEnds_[i])
+	vector<int64_t> lengths_, creationTimes_, lastWriteTimes_;
+	vector<uint64_t> firstClusters_;
+	vector<uint32_t> aux1_;
+	vector<uint8_t> flags_;
+	unordered_map<Index, RareTimes> rareTimes_;
+};
+
+// Decoder of raw filename bytes. Part of the NameTable key: the same bytes decode differently
+enum class NameKind : uint8_t {
+	Text				// Volume::Encoding
+	, Radix50
+	, Files11			// Radix-50 name with version
+};
+
+// Interning table of decoded filenames keyed by the decoder and their raw on-disk bytes.
+// Keys are bump-allocated in large chunks; re-parsing a directory yields shared Strings without allocating
+class NameTable {
+public:
+	static const size_t MaxNames = 1 << 17
+		, MaxKeySize = 512;
+
+	size_t size() const { return map_.size(); }
+	void clear();
+
+	// Returns the String for raw, calling decode(raw) only the first time these bytes are seen with this kind
+	template <class F> String Intern(NameKind kind, RCSpan raw, const F& decode) {
+		if (raw.size() >= MaxKeySize)
+			return decode(raw);
+		char buf[MaxKeySize];
+		buf[0] = (char)kind;
+		memcpy(buf + 1, raw.data(), raw.size());
+		string_view key(buf, raw.size() + 1);
+		if (auto it = map_.find(key); it != map_.end())
+			return it->second;
+		if (map_.size() >= MaxNames)
+			clear();
+		String r = decode(raw);
+		map_.emplace(Store(key), r);
+		return r;
+	}
+private:
+	static const size_t ChunkSize = 16384;
+
+	unordered_map<string_view, String> map_;		// Keys point into chunks_
+	vector<unique_ptr<char[]>> chunks_;
+	size_t chunkUsed_ = ChunkSize;
+
+	string_view Store(string_view key);
+};
+
+// Sector-granular LRU cache of the image contents, shared by all drivers through Volume::ReadAt()/WriteAt()
+class SectorCache {
+public:
+	static const uint32_t SectorSize = 512;
+
+	uint64_t Hits = 0, Misses = 0;			// In sectors
+
+	size_t Budget() const { return budget_; }
+	void SetBudget(size_t bytes);			// 0 disables the cache
+
+	// Returns nullptr if the sector is not cached
+	const uint8_t* Find(uint64_t sector);
+	bool Contains(uint64_t sector) const { return map_.count(sector); }
+	void Put(uint64_t sector, const uint8_t data[SectorSize]);
+
+	// Write-through: patches cached copies of the sectors overlapped by [offset, offset + s.size())
+	void Update(uint64_t offset, RCSpan s);
+	void Invalidate();
+private:
+	typedef array<uint8_t, SectorSize> CSector;
+	typedef list<pair<uint64_t, CSector>> CLru;
+
+	CLru lru_;								// Most recently used first
+	unordered_map<uint64_t, CLru::iterator> map_;
+	size_t budget_ = 4 * 1024 * 1024;
+
+	void Trim();
+};
+
+enum class VolumeOp {
+	Init
+	, GetDirEntries
+	, CopyFileTo
+	, ModifyFile
+	, RemoveFile
+	, Defragment
+	, Count
+};
+
+// Image I/O counters and per-operation latency histograms
+class VolumeStats {
+public:
+	static const int Buckets = 32;				// Bucket i counts latencies in [2^(i-1), 2^i) microseconds, bucket 0 is < 1 us
+
+	struct OpStats {
+		uint64_t Calls = 0
+			, TotalMicroseconds = 0
+			, MaxMicroseconds = 0;
+		uint64_t Histogram[Buckets] = {};
+	};
+
+	// Times the outermost call of op; calls nested in it, such as base::Init(), are not counted again
+	class Timer {
+	public:
+		Timer(VolumeStats& stats, VolumeOp op);
+		~Timer();
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+	private:
+		VolumeStats& stats_;
+		VolumeOp op_;
+		chrono::steady_clock::time_point start_;
+	};
+
+	uint64_t ReadCalls = 0, WriteCalls = 0
+		, BytesRead = 0, BytesWritten = 0
+		, Seeks = 0;							// Accesses not starting where the previous one ended
+
+	const OpStats& operator[](VolumeOp op) const { return ops_[(int)op]; }
+	Timer Time(VolumeOp op) { return Timer(*this, op); }
+
+	void OnRead(uint64_t offset, uint64_t size);
+	void OnWrite(uint64_t offset, uint64_t size);
+	void Reset();
+
+	static const char* OpName(VolumeOp op);
+private:
+	OpStats ops_[(int)VolumeOp::Count];
+	int depth_[(int)VolumeOp::Count] = {};
+	uint64_t nextOffset_ = 0;
+
+	void OnAccess(uint64_t offset, uint64_t size);
+};
+
+// Modified sectors held in memory instead of the image, ordered by sector number.
+// Used both as the copy-on-write overlay and as the write-back buffer
+class SectorOverlay {
+public:
+	typedef array<uint8_t, SectorCache::SectorSize> CSector;
+
+	uint64_t End = 0;						// End of the written bytes, may be past the end of the image
+
+	bool empty() const { return sectors_.empty(); }
+	size_t size() const { return sectors_.size(); }
+
+	CSector* Find(uint64_t sector);
+	CSector& Insert(uint64_t sector, const CSector& data) { return sectors_[sector] = data; }
+	bool Overlaps(uint64_t offset, size_t size) const;
+
+	// Patches sectors already held by [offset, offset + s.size()), doesn't add new ones
+	void Update(uint64_t offset, RCSpan s);
+
+	// Replaces bytes of buf read from [offset, offset + size) with the overlay contents
+	void Apply(uint64_t offset, uint8_t* buf, size_t size) const;
+
+	// Calls f(offset, span) for runs of consecutive sectors in ascending order, each at most maxRun bytes
+	void ForEachRun(size_t maxRun, const function<void(uint64_t, RCSpan)>& f) const;
+
+	void Clear();
+private:
+	map<uint64_t, CSector> sectors_;
+};
+
+// Read-only memory mapping of the whole image file
+class MappedImage {
+public:
+	static const uint64_t MaxSize = sizeof(void*) > 4 ? 16ULL << 30 : 256 << 20;	// Keep 32-bit address space usable
+
+	~MappedImage() { Close(); }
+
+	// Returns false if the file cannot be mapped; callers fall back to stream I/O
+	bool Open(const path& p);
+	void Close();
+	bool IsOpen() const { return data_; }
+	Span View() const { return Span(data_, size_); }
+private:
+	HANDLE hFile_ = INVALID_HANDLE_VALUE
+		, hMapping_ = nullptr;
+	const uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+// Random-access reader of a compressed image. Decompression restarts from the nearest checkpoint of an index,
+// which is built on first open and persisted next to the image
+class CompressedImage {
+public:
+	virtual ~CompressedImage() {}
+
+	uint64_t Length() const { return length_; }
+
+	// Returns less than size only at the end of the image
+	virtual size_t ReadAt(uint64_t offset, void* buf, size_t size) = 0;
+
+	static bool IsCompressed(RCSpan head);
+
+	// Inflates only the start of the image, without building or loading the index. Used for probing
+	static size_t ReadHead(const path& p, void* buf, size_t size);
+
+	// Returns nullptr if the file is not compressed
+	static unique_ptr<CompressedImage> Open(const path& p);
+protected:
+	uint64_t length_ = 0;
+};
+
+// Parsed metadata of an image kept in a per-user cache directory, so that re-opening an unchanged image
+// skips probing and parsing. Valid while the plugin build, the size, last write time and the hash of the first sectors match
+class MetadataCache {
+public:
+	static inline bool Enabled = true;
+
+	static const size_t KeyBytes = 8192;				// Boot and home blocks, start of the FAT
+
+	String FactoryName;
+	map<pair<uint32_t, bool>, vector<DirEntry>> Listings;		// By directory id and bWithExtra
+	vector<uint8_t> DriverData;
+
+	MetadataCache(const path& image);
+	bool Load();			// Returns false if there is no valid sidecar
+	void Save() const;		// Failures are ignored: the metadata is parsed again on next open
+private:
+	path path_;
+	uint64_t imageSize_ = 0, lastWriteTime_ = 0, keyHash_ = 0;
+};
+
+// Image bytes returned by Volume::ReadView(): points directly into the mapped image, or owns a copy if the image is not mapped
+class SectorView {
+public:
+	SectorView(RCSpan s) : span_(s) {}
+
+	SectorView(vector<uint8_t>&& buf)
+		: buf_(std::move(buf))
+		, span_(buf_.data(), buf_.size()) {
+	}
+
+	SectorView(SectorView&&) = default;			// vector move keeps the buffer, so span_ stays valid
+	SectorView(const SectorView&) = delete;
+	SectorView& operator=(const SectorView&) = delete;
+
+	const uint8_t* data() const { return span_.data(); }
+	size_t size() const { return span_.size(); }
+	operator Span() const { return span_; }
+private:
+	vector<uint8_t> buf_;
+	Span span_;
+};
+
+// Run of contiguous sectors (of Volume::BytesPerSector) holding file contents
+struct Extent {
+	uint64_t Lba, Count;
+};
+
+struct CopyJob {
+	const DirEntry* Entry;
+	Stream* Os;
+};
+
+// Immutable catalog of the whole volume built by Volume::Snapshot(). Nothing in it changes after construction,
+// so it may be read by several threads at once
+class VolumeSnapshot {
+public:
+	static const uint32_t npos = UINT32_MAX;
+
+	struct Node {
+		DirEntry Entry;
+		String Path;						// From the root, "\\" separated
+		uint32_t Parent = npos;
+		uint32_t FirstChild = 0, ChildCount = 0;		// Range of Nodes, children of a directory are contiguous
+		uint32_t FirstExtent = 0, ExtentCount = 0;		// Range of Extents, empty if the driver doesn't map files
+	};
+
+	vector<Node> Nodes;						// Entries of the root directory come first
+	vector<Extent> Extents;
+	uint32_t RootCount = 0;
+
+	// Returns nullptr if not found
+	const Node* Find(RCString path) const;
+
+	// dir == nullptr means the root directory
+	span<const Node> Children(const Node* dir) const;
+private:
+	unordered_map<wstring, uint32_t> pathIndex_;
+	bool caseSensitive_ = false;
+
+	wstring Key(RCString path) const;
+
+	friend class Volume;
+};
+
 interface IVolumeCallback {
 	bool Interactive = false;
 
@@ -63,6 +398,10 @@ public:
 
 	CFiles Files;
 	String Filename;
+	SectorCache Cache;
+	VolumeStats Stats;
+	size_t WriteBackLimit = 1024 * 1024;		// Dirty bytes buffered before they are written out; 0 writes through
+	size_t ReadAheadLimit = 64 * 1024;			// Max bytes prefetched into the cache on sequential misses; 0 disables
 
 	String CurDirName;
 	vector<String> CurPath;
@@ -71,19 +410,56 @@ public:
 	virtual ~Volume();
 	virtual void Init(const path& filepath);
 	virtual int64_t FreeSpace() { Throw(E_NOTIMPL); }
-	virtual vector<DirEntry> GetFiles() { return GetDirEntries(0, false); }
+	virtual vector<DirEntry> GetFiles() { return ListDirectory(0, false); }
 	virtual CFiles::iterator GetEntry(RCString filename);
+
+	// O(1) lookup in Files. Returns Files.end() if no entry has this id, e.g. after the entry was modified
+	CFiles::iterator Resolve(EntryId id);
+
+	// Finds the entry by its "\\" or "/" separated path from the root through cached listings.
+	// Doesn't change the current directory. Returns nullopt if not found
+	optional<DirEntry> Lookup(RCString path);
+
+	// Parses the whole directory tree once. Listings come from the listings cache
+	shared_ptr<const VolumeSnapshot> Snapshot();
+
+	// Incremented by every modification of the image contents
+	uint64_t Generation() const { return generation_; }
 	virtual int MaxNameLength() { Throw(E_NOTIMPL); }
 	virtual pair<vector<wchar_t>, vector<wchar_t>> ValidInvalidFilenameChars();
 	virtual void AddFile(const String& filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp);
 	virtual void ChangeDirectory(RCString name);
-	virtual void CopyFileTo(const DirEntry& fileEntry, Stream& os) = 0;
+	virtual void CopyFileTo(const DirEntry& fileEntry, Stream& os);
+
+	// Seekable read-only stream of the contents as CopyFileTo() writes them. The default copies the whole file to memory.
+	// The stream must not use the volume after OpenFile() returns: the shell reads it on its own threads
+	virtual unique_ptr<Stream> OpenFile(const DirEntry& fileEntry);
+
+	// Bulk extraction: extent reads of all jobs are queued with up to queueDepth requests in flight
+	void CopyFilesTo(const vector<CopyJob>& jobs, int queueDepth = 16);
 	virtual void RemoveFile(RCString filename) { Throw(E_NOTIMPL); }
 	virtual void ModifyFile(RCString filename, uint64_t len, Stream& istm, const DateTime& creationTimestamp);
 	virtual void MakeDirectory(RCString name) { Throw(E_NOTIMPL); }
 	virtual void Flush();
+
+	String StatsToJson() const;
+
+	// Metadata cache, see IVolumeFactory::Mount(). The cache passed to UseMetadata() must outlive Init()
+	void UseMetadata(const MetadataCache* cache) { metadata_ = cache; }
+	void CacheMetadata(MetadataCache& cache);
+
+	// Copy-on-write mode: writes are kept in memory and seen by reads. The image stays read-only until Commit(),
+	// which writes each modified sector once. Modifications not committed are lost when the volume is destroyed
+	void BeginOverlay() { overlay_ = true; }
+	bool InOverlay() const { return overlay_; }
+	void Commit();
+	void Discard();
 protected:
 	FileStream Fs;
+	MappedImage Mapping;								// Open only while the image is read-only
+	unique_ptr<CompressedImage> Compressed;				// Replaces Fs for compressed images, which are read-only
+	SectorOverlay Overlay;
+	NameTable Names;				// Decoded with Encoding
 	path filepath_;
 	const Encoding* Encoding;
 
@@ -94,18 +470,96 @@ protected:
 
 	bool CaseSensitive = false;
 	bool _openedForModifying = false;
+private:
+	static const size_t MaxCachedListings = 64;
+
+	const MetadataCache* metadata_ = nullptr;
+	bool overlay_ = false;
+	uint64_t generation_ = 0
+		, listingsGeneration_ = 0;
+	map<pair<uint32_t, bool>, vector<DirEntry>> listings_;		// By directory id and bWithExtra
+	uint64_t readAheadEnd_ = 0							// Sector following the last read from the image
+		, readAheadWindow_ = 0;							// In sectors, doubles while misses stay sequential
+
+	uint64_t ReadAhead(uint64_t sec, uint64_t nSec);
+
+	// Name -> index in Files, case-folded unless CaseSensitive. Rebuilt when Files is replaced or resized
+	unordered_map<wstring, size_t> filesIndex_;
+	unordered_map<EntryId, size_t> idIndex_;				// SIZE_MAX for colliding ids
+	const DirEntry* filesIndexData_ = nullptr;
+	size_t filesIndexSize_ = 0;
+	bool filesIndexValid_ = false
+		, filesIndexCaseSensitive_ = false;
+
+	wstring FilesIndexKey(RCString filename) const;
+	void RebuildFilesIndex();
+	void EnsureFilesIndex();
+	bool NameMatches(const DirEntry& e, RCString filename) const;
+	const vector<DirEntry>& CachedListing(uint32_t dirId, bool bWithExtra);
+protected:
 
 	Volume();
 	String GetFilenamePart(const Span& s);
+	String GetFilename(const Span& name, const Span& ext);		// "NAME.EXT", or "NAME" if ext is blank
+	String GetRadix50Filename(const uint8_t* p, int nNameWords);	// nNameWords of name followed by one of extension
 	Blob EncodeFilenamePart(RCString s);
-	CFiles::iterator Volume::FindEntry(const String& filename);
+	CFiles::iterator Volume::FindEntry(const String& filename);		// O(1) through the filename index
 	void EnsureWriteMode();
+	void WriteBack();									// Writes buffered dirty sectors in sorted, coalesced runs
+
+	uint64_t ImageLength();
+
+	// Uncached read of the image. Returns less than size only at the end of the image
+	size_t ReadImage(uint64_t offset, void* buf, size_t size);
+
+	// Metadata I/O through the sector cache. All writes to the image must go through WriteAt() to keep the cache coherent.
+	// Small writes are buffered until Flush() or WriteBackLimit
+	void ReadAt(uint64_t offset, void* buf, size_t size);
+	void WriteAt(uint64_t offset, RCSpan s);
+	void WriteAt(uint64_t offset, Stream& istm);		// Writes the rest of istm
 
-	// cluster == 0 means Root Directory
-	virtual vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra) = 0;
+	// Zero-copy access when the image is mapped. The view must not outlive the next write to the image
+	SectorView ReadView(uint64_t offset, size_t size);
+	SectorView GetSectors(uint64_t lba, uint64_t count) { return ReadView(lba * BytesPerSector, size_t(count * BytesPerSector)); }
+
+	// Used by the default CopyFileTo(). Drivers storing contents without transformation describe files as extents
+	virtual vector<Extent> GetFileExtents(const DirEntry& entry) { Throw(E_NOTIMPL); }
+
+	// Called before the file contents are written to os
+	virtual void WriteFilePrefix(const DirEntry& fileEntry, Stream& os) {}
+
+	static vector<Extent> MergeExtents(const vector<Extent>& extents);
+
+	// Merges adjacent extents and copies first len bytes of them with large reads
+	void CopyExtentsTo(const vector<Extent>& extents, uint64_t len, Stream& os);
+
+	typedef function<bool(const DirEntry&)> CEnumCallback;
+
+	// Calls f for the entries in on-disk order until it returns false. Returns false if stopped by f
+	virtual bool EnumDirEntries(uint32_t dirId, bool bWithExtra, const CEnumCallback& f) = 0;
+
+	// Collects EnumDirEntries(). cluster == 0 means Root Directory
+	vector<DirEntry> GetDirEntries(uint32_t cluster, bool bWithExtra);
+
+	// GetDirEntries() through a cache of parsed listings, dropped when Generation() changes
+	vector<DirEntry> ListDirectory(uint32_t dirId, bool bWithExtra = false);
+
+	// Directory ids as passed to GetDirEntries(), used by Lookup()
+	virtual uint32_t RootDirectoryId() { return 0; }
+	virtual uint32_t SubdirectoryId(const DirEntry& dir) { return (uint32_t)dir.FirstCluster; }
 
 	virtual void LoadCurDir() { Files = GetFiles(); }
 
+	// Driver state kept in the metadata cache besides the directory listings. LoadMetadata() throws on malformed data
+	virtual void SaveMetadata(Stream& stm) {}
+	virtual void LoadMetadata(const Stream& stm) {}
+
+	// Restores driver state in Init() from the metadata cache. Returns false if the state must be parsed from the image
+	bool RestoreMetadata();
+
+	// Re-reads metadata kept in memory after the image contents changed underneath, e.g. by Discard()
+	virtual void ReloadMetadata() { LoadCurDir(); }
+
 	uint64_t CalcNumberOfClusters(uint64_t len);
 
 	// returns First Cluster/Sector or 0 if there is no space
@@ -126,6 +580,7 @@ interface IVolumeFactory {
 	static vector<IVolumeFactory*>& RegisteredFactories();
 
 	static IVolumeFactory* FindBestFactory(const Span& s);
+	static IVolumeFactory* FindBestFactory(const path& p);		// Probes the decompressed head of compressed images
 	static unique_ptr<Volume> Mount(const path& p);
 
 	// returns weight